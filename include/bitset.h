@@ -0,0 +1,29 @@
+#ifndef __BITSET_H__
+#define __BITSET_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// A set of addresses Base + Min + (i << Shift), i.e. evenly aligned
+// entries of a table (vtables, jump tables, ...).
+struct BitSet
+{
+	uint64_t Min;
+	unsigned Shift;
+	// Bit i set: Min + (i << Shift) is in the set
+	std::vector<bool> Bits;
+	// Byte array of Bits, when they do not fit in an i64
+	llvm::GlobalVariable *Array;
+};
+
+// Build the bitset of Offsets (bytes from the table base). Returns false if
+// some offset is not aligned to 1 << Shift relative to the smallest one.
+bool makeBitSet(llvm::Module &M, std::vector<uint64_t> Offsets, unsigned Shift, BitSet &BS);
+
+// i1 telling whether Addr (i64) is in BS for a table at Base (i64):
+// subtract, rotate, bound check and bitset test.
+llvm::Value *makeBitSetTest(llvm::IRBuilder<> &Builder, llvm::Value *Addr, llvm::Constant *Base, const BitSet &BS);
+
+#endif // __BITSET_H__
@@ -0,0 +1,27 @@
+#ifndef __CASTFLOW_H__
+#define __CASTFLOW_H__
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+// Record the function types each function is cast to (e.g. a handler
+// stored into a `void (*)(void *)` slot).
+void initCastFlow(llvm::Module &M);
+
+// The function types Func is cast to, other than its own.
+const llvm::SmallVectorImpl<llvm::FunctionType *> &getCastFuncTys(llvm::Function *Func);
+
+// The concrete pointer type Val had before being cast to a generic one,
+// nullptr if it is generic all the way.
+llvm::Type *getValueFlowTy(llvm::Value *Val);
+
+// The concrete type Func uses its ArgNo-th parameter as: the declared type
+// if it is concrete, otherwise the single type the body casts it to.
+llvm::Type *getParamFlowTy(llvm::Function *Func, unsigned ArgNo);
+
+// Whether the concrete types flowing into the generic parameters of ICall
+// agree with the types Func expects there.
+bool isCastFlowCompatible(llvm::CallBase *ICall, llvm::Function *Func);
+
+#endif // __CASTFLOW_H__
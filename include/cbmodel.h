@@ -0,0 +1,12 @@
+#ifndef __CBMODEL_H__
+#define __CBMODEL_H__
+
+#include "llvm/IR/Function.h"
+
+// Whether every use of Func other than direct calls hands it to an external
+// API that only calls it back from the library (qsort, pthread_create,
+// atexit, ...). Such functions are never the target of an icall in
+// the program itself.
+bool isLibraryOnlyCallback(llvm::Function *Func);
+
+#endif // __CBMODEL_H__
@@ -0,0 +1,79 @@
+#ifndef __CFI_RT_H__
+#define __CFI_RT_H__
+
+// Interface of the cfi_rt runtime library, called from code instrumented
+// with `-flta-runtime`. One instrumented module per program: set IDs and
+// __cfi_func_addr_array are the ones of that module.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A target set as the instrumenter emits it: relocated addresses, in any
+// order.
+struct __cfi_set_desc
+{
+	const uint64_t *Addrs;
+	uint64_t Size;
+};
+
+// Called by a constructor of the instrumented module: lay every set out
+// for the checker matching its size, then make the tables read-only.
+void __cfi_rt_init(const struct __cfi_set_desc *Sets, uint32_t NumSets);
+
+// Whether Target is in set SetID.
+int __cfi_rt_check(uint32_t SetID, uint64_t Target);
+
+// 0 if Target is the address-taken function FuncID, -1 otherwise.
+int __cfi_icall_checker(uint64_t FuncID, uint64_t Target);
+
+// Same, from __cfi_func_rel_array (-flta-relative-tables): entries are
+// offsets from the array.
+int __cfi_icall_rel_checker(uint64_t FuncID, uint64_t Target);
+
+// Report the violation of icall Site (-1 if it has no __cfi_icall_sites
+// record) by Target on stderr and abort.
+void __cfi_rt_report(int64_t Site, uint64_t Target) __attribute__((noreturn, cold));
+
+// Print Len addresses, one per line (debug builds).
+void __cfi_rt_print_addrs(const uint64_t *Addrs, uint32_t Len);
+
+// -flta-log-only: violations (and with -flta-log-calls, the calls) of each
+// site are counted in a shared-memory segment, which the constructor of the
+// instrumented module creates before the program forks so all its
+// processes count into it. It is named by $CFI_LOG_SHM, or /cfi.<pid>, and
+// left for cfi_log_dump to read. An existing segment of the same layout is
+// joined and keeps its counts; one of another layout is left alone.
+#define CFI_LOG_MAGIC 0x474f4c494643ULL // "CFILOG"
+
+struct __cfi_log_site
+{
+	uint64_t Calls;
+	uint64_t Violations;
+	uint64_t LastTarget;
+};
+
+// The segment: the header, then NumSites + 1 sites, the last one for the
+// calls with no site record.
+struct __cfi_log_header
+{
+	uint64_t Magic;
+	uint64_t NumSites;
+};
+
+// The sites of the segment, null until __cfi_log_init.
+extern struct __cfi_log_site *__cfi_log_sites;
+
+// Map the segment for NumSites sites, once.
+void __cfi_log_init(uint32_t NumSites);
+
+// Count the violation of Site by Target, and return.
+void __cfi_log_violation(int64_t Site, uint64_t Target) __attribute__((cold));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CFI_RT_H__
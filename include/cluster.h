@@ -0,0 +1,24 @@
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Whether Func can be given a slot in a cluster.
+bool isClusterCandidate(const llvm::Function *Func);
+
+// Give each class of functions its own table of `jmp` stubs, one slot of
+// Alignment bytes per function, and hand out the stubs as the functions'
+// addresses (x86-64).
+void makeClusters(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Classes, unsigned Alignment);
+
+// The class Func was placed in, -1 if it was not.
+int getCluster(const llvm::Function *Func);
+
+// i1 telling whether Addr (i64) is the start of a slot of one of the given
+// clusters: a subtract, rotate and unsigned compare per cluster.
+llvm::Value *makeClusterCheck(llvm::IRBuilder<> &Builder, llvm::Value *Addr, const std::vector<unsigned> &Clusters);
+
+#endif // __CLUSTER_H__
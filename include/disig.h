@@ -0,0 +1,31 @@
+#ifndef __DISIG_H__
+#define __DISIG_H__
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+// Source-level function signature recovered from debug info.
+// Element 0 is the return type, the rest are the parameters, each
+// canonicalized to a string (typedefs and qualifiers stripped).
+// An empty signature means "unknown", which matches everything.
+using DISignature = std::vector<std::string>;
+
+// Build the lookup tables (IR struct -> DICompositeType) for M.
+void initDISignatures(llvm::Module &M);
+
+// Signature of an address-taken function, from its DISubprogram.
+const DISignature &getFuncDISignature(const llvm::Function *Func);
+
+// Signature of the function pointer an icall goes through, from the debug
+// info of the variable, field or argument the callee is loaded from.
+const DISignature &getICallDISignature(const llvm::CallBase *ICall);
+
+// Whether a function with signature Func may be called through a pointer
+// with signature ICall. `void *` matches any pointer.
+bool isDISigCompatible(const DISignature &ICall, const DISignature &Func);
+
+#endif // __DISIG_H__
@@ -23,4 +23,12 @@ private:
 	// identifies that particular analysis pass type.
 	static llvm::AnalysisKey Key;
 };
+
+// Expands the __cfi_membership tests FLTA emits with -flta-late-lower
+struct FLTALower : public llvm::PassInfoMixin<FLTALower>
+{
+	llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+
+	static bool isRequired() { return true; }
+};
 #endif // FLTA_H
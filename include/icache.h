@@ -0,0 +1,23 @@
+#ifndef __ICACHE_H__
+#define __ICACHE_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// One cache slot per icall site, Targets[Site] being its allowed targets.
+// A slot holds an index into a read-only table of the targets of each
+// site, so whatever is written there can only select one of them. With
+// Stats, a destructor prints the hits and misses of the sites that ran.
+void makeICache(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Targets, bool Stats);
+
+// i1 telling whether Addr (i64) is the last target that passed the full
+// check at Site: an atomic load, a bound check, a load and a compare.
+llvm::Value *makeICacheLookup(llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned Site);
+
+// Remember Addr (i64) as the last valid target of Site, searching its
+// index in the targets of Site.
+void makeICacheRefresh(llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned Site);
+
+#endif // __ICACHE_H__
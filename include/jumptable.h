@@ -0,0 +1,36 @@
+#ifndef __JUMPTABLE_H__
+#define __JUMPTABLE_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Whether Func can be reached through a jump table entry: it has to be
+// defined here so every address of it we hand out is the entry.
+bool isJumpTableCandidate(const llvm::Function *Func);
+
+// Lay Funcs out, in this order, as 8-byte aligned `jmp` entries of one jump
+// table, and replace every address-taken use of them by their entry.
+void makeJumpTable(llvm::Module &M, const std::vector<llvm::Function *> &Funcs);
+
+// Emit a naked function Name holding one `jmp` entry of 1 << EntryShift
+// bytes per function of Funcs, in this order, and replace every
+// address-taken use of them by their entry. nullptr when Funcs is empty.
+llvm::Function *makeJumpTableFunction(llvm::Module &M, llvm::StringRef Name,
+									  const std::vector<llvm::Function *> &Funcs, unsigned EntryShift);
+
+// Forget the entries handed out so far.
+void clearJumpTableEntries();
+
+// The address Func is handed out at: its entry, or Func when not in a
+// table.
+llvm::Constant *getJumpTableEntry(llvm::Function *Func);
+
+// i1 telling whether Addr (i64) is the jump table entry of one of Targets,
+// all of which must be in the table: subtract, rotate, bound check and
+// bitset test.
+llvm::Value *makeJumpTableCheck(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::Value *Addr,
+								const std::vector<llvm::Function *> &Targets);
+
+#endif // __JUMPTABLE_H__
@@ -0,0 +1,20 @@
+#ifndef __PERFHASH_H__
+#define __PERFHASH_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Give each set a minimal perfect hash table of its addresses. Addresses
+// are only known once relocated, so a constructor builds the tables at
+// startup (a pilot per bucket, as in PTHash) and then makes them
+// read-only. With CFI_MPH_STATS set in the environment it prints the time
+// that took.
+void makePerfectHashes(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Sets);
+
+// i1 telling whether Addr (i64) is in set SetID: hash to a bucket, load
+// its pilot, hash to a slot and compare with the address stored there.
+llvm::Value *makePerfectHashCheck(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned SetID);
+
+#endif // __PERFHASH_H__
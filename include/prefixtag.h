@@ -0,0 +1,24 @@
+#ifndef __PREFIXTAG_H__
+#define __PREFIXTAG_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Whether Func can carry a type tag in its prefix data.
+bool isPrefixTagCandidate(const llvm::Function *Func);
+
+// Put the negated i32 tag of its class right before the entry of each
+// function.
+void makePrefixTags(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Classes);
+
+// The class whose tag Func carries, -1 if it has none.
+int getPrefixTag(const llvm::Function *Func);
+
+// i1 telling whether the word before Addr (i64) is the negated tag of one
+// of the given classes. The word is loaded unconditionally: an Addr that
+// is null or not mapped faults here instead of reaching the report.
+llvm::Value *makePrefixTagCheck(llvm::IRBuilder<> &Builder, llvm::Value *Addr, const std::vector<unsigned> &Classes);
+
+#endif // __PREFIXTAG_H__
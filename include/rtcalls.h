@@ -0,0 +1,40 @@
+#ifndef __RTCALLS_H__
+#define __RTCALLS_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Declarations of the cfi_rt entry points (include/cfi_rt.h).
+#define RT_INIT "__cfi_rt_init"
+#define RT_CHECK "__cfi_rt_check"
+#define RT_REPORT "__cfi_rt_report"
+#define RT_PRINT_ADDRS "__cfi_rt_print_addrs"
+#define RT_LOG_INIT "__cfi_log_init"
+#define RT_LOG_SITES "__cfi_log_sites"
+#define RT_LOG_VIOLATION "__cfi_log_violation"
+
+// Emit the address array of each set and a constructor registering them
+// with __cfi_rt_init, which lays them out and picks their checkers.
+void makeRuntimeSets(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Sets);
+
+// i1 telling whether Addr (i64) is in set SetID, asked to cfi_rt.
+llvm::Value *makeRuntimeCheck(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned SetID);
+
+// The cfi_rt violation report: void (i64 site, i64 target), cold and
+// noreturn.
+llvm::Function *getRuntimeReport(llvm::Module &M);
+
+// A constructor mapping the shared counters of NumSites sites with
+// __cfi_log_init, before the program may fork.
+void makeLogSegment(llvm::Module &M, uint64_t NumSites);
+
+// Count a call of site Site, atomically: the processes share the counter.
+void makeLogCount(llvm::Module &M, llvm::IRBuilder<> &Builder, uint64_t Site);
+
+// The cfi_rt violation counter: void (i64 site, i64 target), cold, it
+// returns.
+llvm::Function *getLogReport(llvm::Module &M);
+
+#endif // __RTCALLS_H__
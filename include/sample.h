@@ -0,0 +1,16 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+// One thread-local countdown per icall site, for the sites checked only
+// once every N executions.
+void makeSampleCounters(llvm::Module &M, unsigned NumSites);
+
+// i1 telling whether this execution of Site runs the full check: its
+// counter is down to 0, and is reset to Rate - 1. The first execution of
+// each thread is always checked.
+llvm::Value *makeSampleGate(llvm::IRBuilder<> &Builder, unsigned Site, unsigned Rate);
+
+#endif // __SAMPLE_H__
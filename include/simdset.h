@@ -0,0 +1,18 @@
+#ifndef __SIMDSET_H__
+#define __SIMDSET_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Lay the addresses of each set out contiguously, cache-line aligned and
+// padded to whole vectors.
+void makeSIMDSets(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Sets);
+
+// i1 telling whether Addr (i64) is in set SetID. The set is scanned
+// whole, 4 (AVX2), 2 (SSE2) or 1 address at a time, the variant picked at
+// load time through an ifunc on x86-64.
+llvm::Value *makeSIMDSetCheck(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned SetID);
+
+#endif // __SIMDSET_H__
@@ -0,0 +1,29 @@
+#ifndef __SORTEDSET_H__
+#define __SORTEDSET_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+// Tables made read-only at startup are aligned and padded to the largest
+// page size of the supported targets (64K on arm64 and ppc64), so mprotect
+// takes whole pages wherever it runs.
+#define TABLE_PAGE_SIZE 65536
+
+// i32 (i8*, i8*) qsort comparator of the i64 keys its arguments point to.
+llvm::Function *getKeyCompare(llvm::Module &M);
+
+// mprotect(Table, Bytes, PROT_READ) where Builder is, aborting if it fails:
+// a table left writable would void the check silently.
+void makeTableReadOnly(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::GlobalVariable *Table, uint64_t Bytes);
+
+// Lay the addresses of each set out in one page-aligned table. Addresses
+// are only known once relocated, so a constructor sorts every set at
+// startup and then makes the table read-only.
+void makeSortedSets(llvm::Module &M, const std::vector<std::vector<llvm::Function *>> &Sets);
+
+// i1 telling whether Addr (i64) is in set SetID: branchless binary search.
+llvm::Value *makeSortedSetCheck(llvm::Module &M, llvm::IRBuilder<> &Builder, llvm::Value *Addr, unsigned SetID);
+
+#endif // __SORTEDSET_H__
@@ -4,6 +4,8 @@
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/Transforms/Utils/FunctionComparator.h>
 
+#include <unordered_set>
+
 #define DEBUG 1
 
 #ifdef DEBUG
@@ -44,6 +46,17 @@ static bool isI8PtrTy(llvm::Type *Ty)
 	return isI8Ptr;
 }
 
+// Pointers that can stand for any other one: i8*, {}* and opaque pointers.
+inline bool isGenericPtrTy(llvm::Type *Ty)
+{
+    auto *PtrTy = llvm::dyn_cast<llvm::PointerType>(Ty);
+    if (nullptr == PtrTy)
+        return false;
+    if (PtrTy->isOpaquePointerTy())
+        return true;
+    return isI8PtrTy(PtrTy) || isEmptyStructPtr(PtrTy);
+}
+
 static bool __isIdenticalType(const llvm::Type *left, const llvm::Type *right)
 {
 
@@ -188,13 +201,13 @@ static bool __isIdenticalType(const llvm::Type *left, const llvm::Type *right)
     }
 }
 
-bool isIdenticalType(const llvm::Type *left, const llvm::Type *right)
+static bool isIdenticalType(const llvm::Type *left, const llvm::Type *right)
 {
     VisitedTypes.clear();
     return __isIdenticalType(left, right);
 }
 
-bool isFuncPtrTy(const llvm::Type *Ty)
+static bool isFuncPtrTy(const llvm::Type *Ty)
 {
     auto *PTy = llvm::dyn_cast<llvm::PointerType>(Ty);
     if (nullptr != PTy)
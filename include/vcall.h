@@ -0,0 +1,38 @@
+#ifndef __VCALL_H__
+#define __VCALL_H__
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+// A C++ virtual call: the callee is loaded from a vtable whose static
+// class is known from an `llvm.type.test` on the vtable pointer (clang
+// -fwhole-program-vtables / -fsanitize=cfi-vcall).
+struct VCallSite
+{
+	llvm::CallBase *ICall;
+	llvm::Value *VTable;
+	llvm::Metadata *TypeId;
+};
+
+// Find the virtual calls of M.
+void initVCalls(llvm::Module &M);
+
+bool isVCall(const llvm::CallBase *ICall);
+
+const std::vector<VCallSite> &getVCalls();
+
+// Lay all vtables carrying !type metadata out in one global, ordered along
+// the class hierarchy, so the vtables compatible with a class form a small
+// range of address points.
+void layoutVTables(llvm::Module &M);
+
+// i1 telling whether VCall's vtable pointer is an address point of a class
+// derived from its static type: subtract, rotate, bound check, bitset test.
+llvm::Value *makeVTableCheck(llvm::IRBuilder<> &Builder, const VCallSite &VCall);
+
+// Remove the type tests of the instrumented virtual calls, nothing lowers
+// them once their vtables are merged.
+void dropVCallTypeTests(llvm::Module &M);
+
+#endif // __VCALL_H__
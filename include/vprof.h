@@ -0,0 +1,20 @@
+#ifndef __VPROF_H__
+#define __VPROF_H__
+
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+#include <utility>
+#include <vector>
+
+// Map the target hashes of value profiles back to the functions of M.
+void initICallProfile(llvm::Module &M);
+
+// Targets the indirect-call value profile (!prof "VP" metadata, from
+// -fprofile-instr-use) recorded for ICall with their counts, most frequent
+// first, and the total number of calls. Targets of other modules are left
+// out of the list but not of the total.
+std::vector<std::pair<llvm::Function *, uint64_t>>
+getICallProfile(const llvm::CallBase *ICall, uint64_t &Total);
+
+#endif // __VPROF_H__
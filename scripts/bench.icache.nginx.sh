@@ -0,0 +1,32 @@
+#!/bin/zsh
+# Build nginx.bc with -flta-check=$MODE, without and with the icall cache,
+# plus a cache build counting hits and misses, then load each with ab.
+# usage: bench.icache.nginx.sh nginx.bc nginx-prefix [requests]
+# nginx-prefix holds conf/nginx.conf (listening on 8080) and html/.
+if [ -z "$2" ]; then
+    echo "please give the nginx .bc file and the nginx prefix"
+    exit 1
+fi
+bc=$1
+prefix=$2
+requests=${3:-100000}
+mode=${MODE:-inline}
+plugin=./build/lib/libFLTA.so
+
+typeset -A flags
+flags=(nocache "" icache "-flta-icache" stats "-flta-icache -flta-icache-stats")
+for name in nocache icache stats; do
+    opt -load $plugin -load-pass-plugin $plugin -passes=flta -flta-check=$mode ${=flags[$name]} $bc -o nginx.$name.bc
+    clang -O2 -ldl -lpthread -lcrypt -lpcre -lz nginx.$name.bc -o nginx.$name
+done
+
+for name in nocache icache stats; do
+    echo "== $name"
+    ./nginx.$name -p $prefix -g "daemon off; master_process off;" 2> nginx.$name.err &
+    sleep 1
+    ab -q -n $requests -c 8 http://127.0.0.1:8080/ | grep -E "Requests per second|Time per request"
+    kill -QUIT $!
+    wait $!
+    # cache statistics are printed when the worker exits
+    grep "CFI icache" nginx.$name.err
+done
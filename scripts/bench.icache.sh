@@ -0,0 +1,82 @@
+#!/bin/zsh
+# One icall site calling 10^8 times through a set of N targets, cycling
+# through 1, 2 or 4 of them, so the icall cache always hits or never does.
+# Builds each mode below and prints the best of 3 runs, in seconds.
+# usage: bench.icache.sh [N]
+targets=${1:-2000}
+plugin=${PLUGIN:-./build/lib/libFLTA.so}
+dir=$(mktemp -d)
+
+{
+    echo 'target triple = "x86_64-pc-linux-gnu"'
+    echo '@n = global i64 100000000'
+    echo '@.str = private constant [4 x i8] c"%d\0A\00"'
+    echo 'declare i32 @printf(i8*, ...)'
+    printf '@tab = global [%d x i32 (i32)*] [' $targets
+    for ((i = 0; i < targets; i++)); do
+        [ $i -gt 0 ] && printf ', '
+        printf 'i32 (i32)* @f%d' $i
+    done
+    echo ']'
+    for ((i = 0; i < targets; i++)); do
+        echo "define i32 @f$i(i32 %x) { %r = add i32 %x, $i"
+        echo ' ret i32 %r }'
+    done
+    # argc 1, 2, 3: the site cycles through 1, 2, 4 targets
+    cat <<EOF
+define i32 @main(i32 %argc, i8** %argv) {
+entry:
+  %n = load volatile i64, i64* @n
+  %c = sub i32 %argc, 1
+  %c64 = zext i32 %c to i64
+  %k = shl i64 1, %c64
+  %mask = sub i64 %k, 1
+  br label %loop
+loop:
+  %i = phi i64 [0, %entry], [%i1, %loop]
+  %s = phi i32 [0, %entry], [%s1, %loop]
+  %j = and i64 %i, %mask
+  %p = getelementptr [$targets x i32 (i32)*], [$targets x i32 (i32)*]* @tab, i64 0, i64 %j
+  %f = load volatile i32 (i32)*, i32 (i32)** %p
+  %v = call i32 %f(i32 %s)
+  %s1 = add i32 %s, %v
+  %i1 = add i64 %i, 1
+  %d = icmp eq i64 %i1, %n
+  br i1 %d, label %out, label %loop
+out:
+  call i32 (i8*, ...) @printf(i8* getelementptr ([4 x i8], [4 x i8]* @.str, i32 0, i32 0), i32 %s1)
+  ret i32 0
+}
+EOF
+} > $dir/bench.ll
+
+modes=(
+    "none"
+    "-flta-check=mph"
+    "-flta-check=mph -flta-icache"
+    "-flta-check=bsearch"
+    "-flta-check=bsearch -flta-icache"
+)
+for mode in "${modes[@]}"; do
+    if [ "$mode" = "none" ]; then
+        opt -passes='default<O2>' -S $dir/bench.ll -o $dir/bench.out.ll || exit 1
+    else
+        opt -load $plugin -load-pass-plugin $plugin -passes='flta,default<O2>' $(echo $mode) \
+            -S $dir/bench.ll -o $dir/bench.out.ll || exit 1
+    fi
+    llc -O2 -relocation-model=pic $dir/bench.out.ll -o $dir/bench.s && cc $dir/bench.s -o $dir/bench || exit 1
+
+    line="$mode:"
+    for args in "" "x" "x x"; do
+        best=""
+        for run in 1 2 3; do
+            start=$(date +%s.%N)
+            $dir/bench $(echo $args) > /dev/null
+            end=$(date +%s.%N)
+            best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.2f", t }')
+        done
+        line="$line $best"
+    done
+    echo $line
+done
+rm -r $dir
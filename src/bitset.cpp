@@ -0,0 +1,95 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Intrinsics.h"
+
+#include "bitset.h"
+
+using namespace llvm;
+
+#define BITSET_SYMBOL "__cfi_bitset"
+
+bool makeBitSet(Module &M, std::vector<uint64_t> Offsets, unsigned Shift, BitSet &BS)
+{
+	assert(!Offsets.empty() && "An empty set has no bitset!");
+	std::sort(Offsets.begin(), Offsets.end());
+	Offsets.erase(std::unique(Offsets.begin(), Offsets.end()), Offsets.end());
+
+	BS.Min = Offsets.front();
+	BS.Shift = Shift;
+	BS.Bits.assign(((Offsets.back() - BS.Min) >> Shift) + 1, false);
+	BS.Array = nullptr;
+	for (auto &&Offset : Offsets)
+	{
+		if ((Offset - BS.Min) & ((1ULL << Shift) - 1))
+			return false;
+		BS.Bits[(Offset - BS.Min) >> Shift] = true;
+	}
+
+	if (BS.Bits.size() <= 64)
+		return true;
+
+	std::vector<uint8_t> Bytes((BS.Bits.size() + 7) / 8, 0);
+	for (uint64_t i = 0; i < BS.Bits.size(); i++)
+		if (BS.Bits[i])
+			Bytes[i / 8] |= 1 << (i % 8);
+
+	// Identical byte arrays are shared, constant data is uniqued
+	auto *Init = ConstantDataArray::get(M.getContext(), Bytes);
+	GlobalVariable *Array = nullptr;
+	for (auto &&U : Init->users())
+	{
+		auto *GV = dyn_cast<GlobalVariable>(U);
+		if (nullptr != GV && GV->getParent() == &M && GV->getName().startswith(BITSET_SYMBOL))
+			Array = GV;
+	}
+	if (nullptr == Array)
+	{
+		Array = new GlobalVariable(
+			M, Init->getType(), true, GlobalValue::PrivateLinkage,
+			Init, BITSET_SYMBOL);
+		Array->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+	}
+	BS.Array = Array;
+	return true;
+}
+
+Value *
+makeBitSetTest(IRBuilder<> &Builder, Value *Addr, Constant *Base, const BitSet &BS)
+{
+	auto *I64Ty = Builder.getInt64Ty();
+	auto NumBits = BS.Bits.size();
+
+	// Rotating right moves misaligned addresses far out of range
+	auto *Start = ConstantExpr::getAdd(Base, ConstantInt::get(I64Ty, BS.Min));
+	auto *Diff = Builder.CreateSub(Addr, Start);
+	auto *Rot = Builder.CreateIntrinsic(
+		Intrinsic::fshr, {I64Ty},
+		{Diff, Diff, ConstantInt::get(I64Ty, BS.Shift)});
+	auto *InRange = Builder.CreateICmpULE(Rot, ConstantInt::get(I64Ty, NumBits - 1));
+
+	if (std::all_of(BS.Bits.begin(), BS.Bits.end(), [](bool Bit)
+					{ return Bit; }))
+		return InRange;
+
+	Value *Bit = nullptr;
+	if (nullptr == BS.Array)
+	{
+		uint64_t Bits = 0;
+		for (uint64_t i = 0; i < NumBits; i++)
+			if (BS.Bits[i])
+				Bits |= 1ULL << i;
+		auto *Shift = Builder.CreateAnd(Rot, ConstantInt::get(I64Ty, 63));
+		Bit = Builder.CreateLShr(ConstantInt::get(I64Ty, Bits), Shift);
+	}
+	else
+	{
+		// Keep the load in bounds, InRange decides anyway
+		auto *Idx = Builder.CreateSelect(InRange, Rot, ConstantInt::get(I64Ty, 0));
+		auto *ByteAddr = Builder.CreateInBoundsGEP(
+			BS.Array->getValueType(), BS.Array,
+			{ConstantInt::get(I64Ty, 0), Builder.CreateLShr(Idx, 3)});
+		auto *Byte = Builder.CreateZExt(Builder.CreateLoad(Builder.getInt8Ty(), ByteAddr), I64Ty);
+		Bit = Builder.CreateLShr(Byte, Builder.CreateAnd(Idx, ConstantInt::get(I64Ty, 7)));
+	}
+	Bit = Builder.CreateTrunc(Bit, Builder.getInt1Ty());
+	return Builder.CreateAnd(InRange, Bit);
+}
@@ -0,0 +1,181 @@
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Instructions.h"
+
+#include "castflow.h"
+#include "utils.h"
+
+#include <map>
+
+using namespace llvm;
+
+static DenseMap<Function *, SmallVector<FunctionType *, 2>> CastFuncTys;
+static std::map<std::pair<Function *, unsigned>, Type *> ParamFlowTys;
+
+static const SmallVector<FunctionType *, 2> NoCastFuncTys;
+
+void initCastFlow(Module &M)
+{
+	CastFuncTys.clear();
+	ParamFlowTys.clear();
+
+	for (auto &Func : M)
+	{
+		for (auto &&U : Func.users())
+		{
+			auto *CE = dyn_cast<ConstantExpr>(U);
+			if (nullptr == CE || !CE->isCast() || CE->getType()->isOpaquePointerTy())
+				continue;
+			auto *FuncTy = dyn_cast<FunctionType>(CE->getType()->getPointerElementType());
+			if (nullptr == FuncTy || FuncTy == Func.getFunctionType())
+				continue;
+
+			auto &Tys = CastFuncTys[&Func];
+			if (std::find(Tys.begin(), Tys.end(), FuncTy) == Tys.end())
+				Tys.push_back(FuncTy);
+		}
+	}
+}
+
+const SmallVectorImpl<FunctionType *> &
+getCastFuncTys(Function *Func)
+{
+	auto It = CastFuncTys.find(Func);
+	if (It == CastFuncTys.end())
+		return NoCastFuncTys;
+	return It->second;
+}
+
+Type *
+getValueFlowTy(Value *Val)
+{
+	auto *Ty = Val->stripPointerCasts()->getType();
+	if (!Ty->isPointerTy() || isGenericPtrTy(Ty))
+		return nullptr;
+	return Ty;
+}
+
+// Collect the pointer types Val is cast to, following it through the stack
+// slot clang spills arguments to at -O0.
+static void
+collectCastTys(Value *Val, SmallPtrSetImpl<Type *> &Tys, SmallPtrSetImpl<Value *> &Visited)
+{
+	if (!Visited.insert(Val).second)
+		return;
+
+	for (auto &&U : Val->users())
+	{
+		if (auto *BC = dyn_cast<BitCastInst>(U))
+		{
+			if (isGenericPtrTy(BC->getType()))
+				collectCastTys(BC, Tys, Visited);
+			else
+				Tys.insert(BC->getType());
+			continue;
+		}
+
+		auto *SI = dyn_cast<StoreInst>(U);
+		if (nullptr == SI || SI->getValueOperand() != Val)
+			continue;
+		auto *Slot = dyn_cast<AllocaInst>(SI->getPointerOperand());
+		if (nullptr == Slot)
+			continue;
+
+		// Loads of a slot written more than once may see other values.
+		unsigned NumStores = 0;
+		for (auto &&SlotUser : Slot->users())
+			if (isa<StoreInst>(SlotUser))
+				NumStores++;
+		if (NumStores != 1)
+			continue;
+
+		for (auto &&SlotUser : Slot->users())
+			if (auto *LI = dyn_cast<LoadInst>(SlotUser))
+				collectCastTys(LI, Tys, Visited);
+	}
+}
+
+Type *
+getParamFlowTy(Function *Func, unsigned ArgNo)
+{
+	auto Key = std::make_pair(Func, ArgNo);
+	auto It = ParamFlowTys.find(Key);
+	if (It != ParamFlowTys.end())
+		return It->second;
+
+	Type *FlowTy = nullptr;
+	auto *Arg = Func->getArg(ArgNo);
+	if (!isGenericPtrTy(Arg->getType()))
+	{
+		FlowTy = Arg->getType();
+	}
+	else if (!Func->isDeclaration())
+	{
+		SmallPtrSet<Type *, 4> Tys;
+		SmallPtrSet<Value *, 8> Visited;
+		collectCastTys(Arg, Tys, Visited);
+		// Used as several types: a union-like parameter, no conclusion.
+		if (Tys.size() == 1)
+			FlowTy = *Tys.begin();
+	}
+	return ParamFlowTys[Key] = FlowTy;
+}
+
+// Whether a `Left *` may legitimately be viewed as a `Right *`. C code
+// reaches an object through a pointer to its first member, to the first
+// element of an array, or to a record sharing its leading field, so only
+// pointees that differ already in their first scalar tell the two apart.
+static bool
+isFlowTyCompatible(Type *Left, Type *Right)
+{
+	if (isIdenticalType(Left, Right))
+		return true;
+	if (!Left->isPointerTy() || !Right->isPointerTy())
+		return false;
+
+	auto FirstScalar = [](Type *Ty)
+	{
+		while (true)
+		{
+			if (auto *STy = dyn_cast<StructType>(Ty))
+			{
+				if (STy->isOpaque() || STy->getNumElements() == 0)
+					return (Type *)nullptr;
+				Ty = STy->getElementType(0);
+			}
+			else if (auto *ATy = dyn_cast<ArrayType>(Ty))
+				Ty = ATy->getElementType();
+			else if (auto *VTy = dyn_cast<VectorType>(Ty))
+				Ty = VTy->getElementType();
+			else
+				return Ty;
+		}
+	};
+	auto *LeftScalar = FirstScalar(Left->getPointerElementType());
+	auto *RightScalar = FirstScalar(Right->getPointerElementType());
+	// Keep the unnarrowed set when a side has no known layout
+	if (nullptr == LeftScalar || nullptr == RightScalar)
+		return true;
+	return isIdenticalType(LeftScalar, RightScalar);
+}
+
+bool isCastFlowCompatible(CallBase *ICall, Function *Func)
+{
+	auto *ICallTy = ICall->getFunctionType();
+	auto *FuncTy = Func->getFunctionType();
+	auto NumParams = std::min(ICallTy->getNumParams(), FuncTy->getNumParams());
+
+	for (unsigned i = 0; i < NumParams; i++)
+	{
+		// Concrete on both sides: the type match has already decided.
+		if (!isGenericPtrTy(ICallTy->getParamType(i)) && !isGenericPtrTy(FuncTy->getParamType(i)))
+			continue;
+
+		auto *ICallFlowTy = getValueFlowTy(ICall->getArgOperand(i));
+		auto *FuncFlowTy = getParamFlowTy(Func, i);
+		if (nullptr == ICallFlowTy || nullptr == FuncFlowTy)
+			continue;
+		if (!isFlowTyCompatible(ICallFlowTy, FuncFlowTy))
+			return false;
+	}
+	return true;
+}
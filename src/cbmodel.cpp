@@ -0,0 +1,146 @@
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+
+#include "cbmodel.h"
+
+using namespace llvm;
+
+// External APIs taking a callback they invoke themselves, and the argument
+// holding it. An API with several callbacks has one entry per argument.
+struct CallbackModel
+{
+	const char *API;
+	unsigned ArgNo;
+};
+
+static const CallbackModel CallbackModels[] = {
+	// <stdlib.h>
+	{"qsort", 3},
+	{"qsort_r", 3},
+	{"bsearch", 4},
+	{"atexit", 0},
+	{"at_quick_exit", 0},
+	{"on_exit", 0},
+	{"__cxa_atexit", 0},
+	// <search.h>
+	{"lfind", 4},
+	{"lsearch", 4},
+	{"tsearch", 2},
+	{"tfind", 2},
+	{"tdelete", 2},
+	{"twalk", 1},
+	{"tdestroy", 1},
+	// <pthread.h>
+	{"pthread_create", 2},
+	{"pthread_once", 1},
+	{"pthread_key_create", 1},
+	{"pthread_atfork", 0},
+	{"pthread_atfork", 1},
+	{"pthread_atfork", 2},
+	// Not <signal.h>: signal() and sigaction() hand the previous handler
+	// back, and programs call it, `old = signal(s, h); ... old(s);`
+	// <dirent.h>, <ftw.h>, <glob.h>
+	{"scandir", 2},
+	{"scandir", 3},
+	{"ftw", 1},
+	{"nftw", 1},
+	{"glob", 2},
+	// <link.h>, <ucontext.h>
+	{"dl_iterate_phdr", 0},
+	{"makecontext", 1},
+};
+
+static bool
+isModeledCallbackArg(const CallBase *CB, unsigned ArgNo)
+{
+	auto *Callee = dyn_cast<Function>(CB->getCalledOperand()->stripPointerCasts());
+	// A definition in the module may call it from anywhere.
+	if (nullptr == Callee || !Callee->isDeclaration())
+		return false;
+
+	for (auto &&Model : CallbackModels)
+	{
+		if (Callee->getName() == Model.API && ArgNo == Model.ArgNo)
+			return true;
+	}
+	return false;
+}
+
+static bool
+onlyReachesModeledAPIs(const Value *Val, SmallPtrSetImpl<const Value *> &Visited);
+
+// Val is stored into Slot: fine if Slot is a stack slot written once whose
+// loads only reach modeled APIs (-O0 code).
+static bool
+isModeledStore(const Value *Val, const Value *Slot, SmallPtrSetImpl<const Value *> &Visited)
+{
+	auto *AI = dyn_cast<AllocaInst>(Slot->stripPointerCasts());
+	if (nullptr == AI)
+		return false;
+	for (auto &&U : AI->users())
+	{
+		if (auto *SI = dyn_cast<StoreInst>(U))
+		{
+			if (SI->getValueOperand() != Val)
+				return false;
+			continue;
+		}
+		if (auto *LI = dyn_cast<LoadInst>(U))
+		{
+			if (!onlyReachesModeledAPIs(LI, Visited))
+				return false;
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+static bool
+onlyReachesModeledAPIs(const Value *Val, SmallPtrSetImpl<const Value *> &Visited)
+{
+	if (!Visited.insert(Val).second)
+		return true;
+
+	for (auto &&U : Val->uses())
+	{
+		auto *User = U.getUser();
+
+		if (auto *CB = dyn_cast<CallBase>(User))
+		{
+			// Direct calls do not take the address
+			if (CB->isCallee(&U))
+				continue;
+			if (CB->isArgOperand(&U) && isModeledCallbackArg(CB, CB->getArgOperandNo(&U)))
+				continue;
+			return false;
+		}
+
+		if (auto *SI = dyn_cast<StoreInst>(User))
+		{
+			if (SI->getValueOperand() == Val && isModeledStore(Val, SI->getPointerOperand(), Visited))
+				continue;
+			return false;
+		}
+
+		if (isa<BitCastOperator>(User))
+		{
+			if (onlyReachesModeledAPIs(User, Visited))
+				continue;
+			return false;
+		}
+
+		return false;
+	}
+	return true;
+}
+
+bool isLibraryOnlyCallback(Function *Func)
+{
+	SmallPtrSet<const Value *, 8> Visited;
+	if (!Func->hasAddressTaken())
+		return false;
+	return onlyReachesModeledAPIs(Func, Visited);
+}
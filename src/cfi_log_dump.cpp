@@ -0,0 +1,62 @@
+// Print the counters of a -flta-log-only segment, the sites that were
+// called or violated.
+// usage: cfi_log_dump <segment name, e.g. /cfi.1234> [-u: unlink it]
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cfi_rt.h"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <segment> [-u]\n", argv[0]);
+		return 1;
+	}
+	int FD = shm_open(argv[1], O_RDONLY, 0);
+	struct stat St;
+	if (FD < 0 || fstat(FD, &St) < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	void *Mem = mmap(nullptr, St.st_size, PROT_READ, MAP_SHARED, FD, 0);
+	close(FD);
+	auto *Header = static_cast<const __cfi_log_header *>(Mem);
+	if (MAP_FAILED == Mem || (size_t)St.st_size < sizeof(*Header) || CFI_LOG_MAGIC != Header->Magic ||
+		(size_t)St.st_size < sizeof(*Header) + (Header->NumSites + 1) * sizeof(__cfi_log_site))
+	{
+		fprintf(stderr, "%s: not a CFI log segment\n", argv[1]);
+		return 1;
+	}
+
+	// Counters may move under us, a snapshot of each is enough
+	auto *Sites = reinterpret_cast<const __cfi_log_site *>(Header + 1);
+	uint64_t Calls = 0, Violations = 0;
+	printf("%8s %14s %12s %18s\n", "site", "calls", "violations", "last target");
+	for (uint64_t i = 0; i <= Header->NumSites; i++)
+	{
+		uint64_t C = __atomic_load_n(&Sites[i].Calls, __ATOMIC_RELAXED);
+		uint64_t V = __atomic_load_n(&Sites[i].Violations, __ATOMIC_RELAXED);
+		if (0 == C && 0 == V)
+			continue;
+		char Site[24];
+		snprintf(Site, sizeof(Site), "%" PRIu64, i);
+		printf("%8s %14" PRIu64 " %12" PRIu64 " %18p\n",
+			   i == Header->NumSites ? "-1" : Site, C, V,
+			   (void *)__atomic_load_n(&Sites[i].LastTarget, __ATOMIC_RELAXED));
+		Calls += C;
+		Violations += V;
+	}
+	printf("%8s %14" PRIu64 " %12" PRIu64 "\n", "total", Calls, Violations);
+
+	if (argc > 2 && 0 == strcmp(argv[2], "-u"))
+		shm_unlink(argv[1]);
+	return 0;
+}
@@ -0,0 +1,272 @@
+// cfi_rt: checks, tables and reporting for instrumented programs, in place
+// of the same pieces synthesized as IR.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cfi_rt.h"
+
+// Only the instrumented module defines them, the benchmark does not
+extern "C" uint64_t __cfi_func_addr_array[] __attribute__((weak));
+extern "C" int32_t __cfi_func_rel_array[] __attribute__((weak));
+
+namespace
+{
+
+// Sets up to SMALL_SET_MAX addresses are compared unrolled, larger ones
+// binary-searched once sorted: cfi_rt_bench finds the search of 16 or 32
+// addresses faster than a whole-set scan of 16.
+#define SMALL_SET_MAX 8
+// Largest page size of the supported targets
+#define MAX_PAGE_SIZE 65536
+
+// The checker of a set, dispatched with a switch: no function pointer in
+// memory to overwrite
+enum SetKind : uint64_t
+{
+	SET_SMALL,
+	SET_SORTED,
+};
+
+struct Set
+{
+	SetKind Kind;
+	const uint64_t *Addrs;
+	uint64_t Size;
+};
+
+// Where the sets are, in pages of their own made read-only once written
+struct alignas(MAX_PAGE_SIZE) SetTable
+{
+	const Set *Sets;
+	uint32_t NumSets;
+};
+
+SetTable Table;
+
+void
+protect(void *Mem, uint64_t Bytes)
+{
+	if (0 != mprotect(Mem, Bytes, PROT_READ))
+	{
+		perror("cfi_rt: mprotect");
+		abort();
+	}
+}
+
+// N compares ORed together, no branch
+template <unsigned N>
+bool checkSmall(const uint64_t *Addrs, uint64_t Target)
+{
+	bool Found = false;
+	for (unsigned i = 0; i < N; i++)
+		Found |= Addrs[i] == Target;
+	return Found;
+}
+
+bool checkSmall(const uint64_t *Addrs, uint64_t Size, uint64_t Target)
+{
+	switch (Size)
+	{
+	case 1: return checkSmall<1>(Addrs, Target);
+	case 2: return checkSmall<2>(Addrs, Target);
+	case 3: return checkSmall<3>(Addrs, Target);
+	case 4: return checkSmall<4>(Addrs, Target);
+	case 5: return checkSmall<5>(Addrs, Target);
+	case 6: return checkSmall<6>(Addrs, Target);
+	case 7: return checkSmall<7>(Addrs, Target);
+	case 8: return checkSmall<8>(Addrs, Target);
+	default: return false;
+	}
+}
+
+// Branchless lower bound on a sorted set
+bool checkSorted(const uint64_t *Addrs, uint64_t Size, uint64_t Target)
+{
+	const uint64_t *Base = Addrs;
+	while (Size > 1)
+	{
+		uint64_t Half = Size / 2;
+		Base = Base[Half] <= Target ? Base + Half : Base;
+		Size -= Half;
+	}
+	return *Base == Target;
+}
+
+} // namespace
+
+extern "C" void
+__cfi_rt_init(const __cfi_set_desc *Descs, uint32_t Num)
+{
+	uint64_t Bytes = Num * sizeof(Set);
+	for (uint32_t i = 0; i < Num; i++)
+		Bytes += Descs[i].Size * sizeof(uint64_t);
+	long Page = sysconf(_SC_PAGESIZE);
+	Bytes = (Bytes + Page - 1) / Page * Page;
+	if (0 == Bytes)
+		return;
+	if (nullptr != Table.Sets)
+	{
+		dprintf(2, "cfi_rt: sets registered twice\n");
+		abort();
+	}
+
+	void *Mem = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == Mem)
+	{
+		perror("cfi_rt: mmap");
+		abort();
+	}
+	auto *Layout = static_cast<Set *>(Mem);
+	auto *Addrs = reinterpret_cast<uint64_t *>(Layout + Num);
+	for (uint32_t i = 0; i < Num; i++)
+	{
+		auto Size = Descs[i].Size;
+		std::copy(Descs[i].Addrs, Descs[i].Addrs + Size, Addrs);
+		if (Size <= SMALL_SET_MAX)
+			Layout[i].Kind = SET_SMALL;
+		else
+		{
+			std::sort(Addrs, Addrs + Size);
+			Layout[i].Kind = SET_SORTED;
+		}
+		Layout[i].Addrs = Addrs;
+		Layout[i].Size = Size;
+		Addrs += Size;
+	}
+	protect(Mem, Bytes);
+	Table.Sets = Layout;
+	Table.NumSets = Num;
+	protect(&Table, sizeof(Table));
+}
+
+extern "C" int
+__cfi_rt_check(uint32_t SetID, uint64_t Target)
+{
+	if (SetID >= Table.NumSets)
+		return 0;
+	const Set &S = Table.Sets[SetID];
+	switch (S.Kind)
+	{
+	case SET_SMALL:
+		return checkSmall(S.Addrs, S.Size, Target);
+	case SET_SORTED:
+		return checkSorted(S.Addrs, S.Size, Target);
+	}
+	return 0;
+}
+
+extern "C" int
+__cfi_icall_checker(uint64_t FuncID, uint64_t Target)
+{
+	return __cfi_func_addr_array[FuncID] == Target ? 0 : -1;
+}
+
+extern "C" int
+__cfi_icall_rel_checker(uint64_t FuncID, uint64_t Target)
+{
+	auto Base = reinterpret_cast<uint64_t>(__cfi_func_rel_array);
+	return Base + __cfi_func_rel_array[FuncID] == Target ? 0 : -1;
+}
+
+extern "C" void
+__cfi_rt_report(int64_t Site, uint64_t Target)
+{
+	dprintf(2, "CFI violation detected!!! site %" PRId64 ", target %p\n", Site, (void *)Target);
+	abort();
+}
+
+struct __cfi_log_site *__cfi_log_sites = nullptr;
+
+static uint64_t LogNumSites = 0;
+
+extern "C" void
+__cfi_log_init(uint32_t NumSites)
+{
+	if (nullptr != __cfi_log_sites)
+		return;
+	// No libstdc++ here: C programs link us too
+	char Name[64];
+	const char *Env = getenv("CFI_LOG_SHM");
+	if (Env)
+		snprintf(Name, sizeof(Name), "%s", Env);
+	else
+		snprintf(Name, sizeof(Name), "/cfi.%d", getpid());
+	size_t Bytes = sizeof(__cfi_log_header) + (NumSites + 1) * sizeof(__cfi_log_site);
+
+	// MAP_SHARED either way: the forked processes share the counters.
+	// An existing segment is joined, not cleared: a second run of the
+	// program (nginx -s reload, -t) keeps counting into it.
+	void *Mem = MAP_FAILED;
+	const char *Problem = "can not create";
+	int FD = shm_open(Name, O_CREAT | O_RDWR, 0600);
+	struct stat St;
+	if (FD >= 0 && 0 == fstat(FD, &St))
+	{
+		// Empty: new, or its creator is about to size it the same way. Of
+		// another size, part of the mapping would raise SIGBUS.
+		bool Sized = 0 == St.st_size ? 0 == ftruncate(FD, Bytes) : (size_t)St.st_size == Bytes;
+		if (Sized)
+			Mem = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+		else
+			Problem = "can not use";
+	}
+	if (FD >= 0)
+		close(FD);
+
+	auto *Header = static_cast<__cfi_log_header *>(Mem);
+	if (MAP_FAILED != Mem)
+	{
+		// A new segment is all zero, the sites too; racing creators write
+		// the same header
+		if (0 == __atomic_load_n(&Header->Magic, __ATOMIC_ACQUIRE))
+		{
+			Header->NumSites = NumSites;
+			__atomic_store_n(&Header->Magic, CFI_LOG_MAGIC, __ATOMIC_RELEASE);
+		}
+		if (CFI_LOG_MAGIC != Header->Magic || NumSites != Header->NumSites)
+		{
+			munmap(Mem, Bytes);
+			Mem = MAP_FAILED;
+			Problem = "can not use";
+		}
+	}
+	if (MAP_FAILED == Mem)
+	{
+		dprintf(2, "cfi_rt: %s /dev/shm%s, counting privately\n", Problem, Name);
+		Mem = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == Mem)
+			return;
+		Header = static_cast<__cfi_log_header *>(Mem);
+		Header->NumSites = NumSites;
+		Header->Magic = CFI_LOG_MAGIC;
+	}
+	else
+		dprintf(2, "cfi_rt: counting violations in /dev/shm%s\n", Name);
+
+	LogNumSites = NumSites;
+	__cfi_log_sites = reinterpret_cast<__cfi_log_site *>(Header + 1);
+}
+
+extern "C" void
+__cfi_log_violation(int64_t Site, uint64_t Target)
+{
+	if (nullptr == __cfi_log_sites)
+		return;
+	auto &S = __cfi_log_sites[Site >= 0 && (uint64_t)Site < LogNumSites ? Site : LogNumSites];
+	__atomic_fetch_add(&S.Violations, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&S.LastTarget, Target, __ATOMIC_RELAXED);
+}
+
+extern "C" void
+__cfi_rt_print_addrs(const uint64_t *Addrs, uint32_t Len)
+{
+	for (uint32_t i = 0; i < Len; i++)
+		printf("%p\n", (void *)Addrs[i]);
+}
@@ -0,0 +1,71 @@
+// Time __cfi_rt_check on sets of several sizes, for targets in the set
+// (hit) and out of it (miss).
+// usage: cfi_rt_bench [checks per set]
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <vector>
+
+#include "cfi_rt.h"
+
+static const uint64_t SetSizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 512, 2048};
+
+static double
+getNs()
+{
+	timespec TS;
+	clock_gettime(CLOCK_MONOTONIC, &TS);
+	return TS.tv_sec * 1e9 + TS.tv_nsec;
+}
+
+// ns per check of Targets against SetID, the result summed so the calls
+// are not dropped
+static double
+timeChecks(uint32_t SetID, const std::vector<uint64_t> &Targets, uint64_t Checks, uint64_t &Sink)
+{
+	double Start = getNs();
+	for (uint64_t i = 0; i < Checks; i++)
+		Sink += __cfi_rt_check(SetID, Targets[i % Targets.size()]);
+	return (getNs() - Start) / Checks;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t Checks = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+	std::mt19937_64 Rand(42);
+	// Function-like addresses: 16-byte aligned in a 16 MB text segment
+	auto RandomAddr = [&]()
+	{ return 0x555555554000ULL + (Rand() % (1 << 20)) * 16; };
+
+	std::vector<std::vector<uint64_t>> Addrs;
+	std::vector<__cfi_set_desc> Descs;
+	for (auto Size : SetSizes)
+	{
+		Addrs.emplace_back();
+		for (uint64_t i = 0; i < Size; i++)
+			Addrs.back().push_back(RandomAddr());
+	}
+	for (auto &Set : Addrs)
+		Descs.push_back({Set.data(), Set.size()});
+	__cfi_rt_init(Descs.data(), Descs.size());
+
+	uint64_t Sink = 0;
+	printf("%8s %10s %10s\n", "size", "hit ns", "miss ns");
+	for (uint32_t SetID = 0; SetID < Descs.size(); SetID++)
+	{
+		std::vector<uint64_t> Hits, Misses;
+		for (unsigned i = 0; i < 1024; i++)
+		{
+			Hits.push_back(Addrs[SetID][Rand() % Addrs[SetID].size()]);
+			// odd, so never a member
+			Misses.push_back(RandomAddr() + 1);
+		}
+		double Hit = timeChecks(SetID, Hits, Checks, Sink);
+		double Miss = timeChecks(SetID, Misses, Checks, Sink);
+		printf("%8lu %10.2f %10.2f\n", (unsigned long)SetSizes[SetID], Hit, Miss);
+	}
+	// Every hit counts one
+	return Sink == Checks * Descs.size() ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "cluster.h"
+#include "jumptable.h"
+
+using namespace llvm;
+
+#define CLUSTER_SYMBOL_PREFIX "__cfi_class_"
+
+static unsigned ClusterShift = 4;
+static DenseMap<const Function *, unsigned> Func2Cluster;
+// Stub table of each cluster and its number of entries
+static std::vector<std::pair<Function *, uint64_t>> ClusterTables;
+
+bool isClusterCandidate(const Function *Func)
+{
+	return isJumpTableCandidate(Func);
+}
+
+void makeClusters(Module &M, const std::vector<std::vector<Function *>> &Classes, unsigned Alignment)
+{
+	// A `jmp rel32` has to fit in a slot
+	if (!isPowerOf2_32(Alignment) || Alignment < 8)
+		report_fatal_error("FLTA: cluster alignment must be a power of 2 of at least 8");
+	ClusterShift = Log2_32(Alignment);
+	Func2Cluster.clear();
+	ClusterTables.clear();
+	clearJumpTableEntries();
+
+	for (unsigned i = 0; i < Classes.size(); i++)
+	{
+		std::vector<Function *> Stubbed;
+		for (auto &&Func : Classes[i])
+		{
+			if (!isClusterCandidate(Func) || Func2Cluster.count(Func))
+				continue;
+			Stubbed.push_back(Func);
+			Func2Cluster[Func] = i;
+		}
+		ClusterTables.push_back(std::make_pair(
+			makeJumpTableFunction(M, CLUSTER_SYMBOL_PREFIX + std::to_string(i), Stubbed, ClusterShift),
+			Stubbed.size()));
+	}
+}
+
+int getCluster(const Function *Func)
+{
+	auto It = Func2Cluster.find(Func);
+	if (It == Func2Cluster.end())
+		return -1;
+	return It->second;
+}
+
+Value *
+makeClusterCheck(IRBuilder<> &Builder, Value *Addr, const std::vector<unsigned> &Clusters)
+{
+	auto *I64Ty = Builder.getInt64Ty();
+	Value *InRange = Builder.getFalse();
+	for (auto &&Cluster : Clusters)
+	{
+		auto *Start = ConstantExpr::getPtrToInt(ClusterTables[Cluster].first, I64Ty);
+		// Rotating right moves misaligned addresses far out of range, so
+		// start <= addr < stop on a slot boundary is one unsigned compare
+		auto *Diff = Builder.CreateSub(Addr, Start);
+		auto *Rot = Builder.CreateIntrinsic(
+			Intrinsic::fshr, {I64Ty},
+			{Diff, Diff, ConstantInt::get(I64Ty, ClusterShift)});
+		InRange = Builder.CreateOr(
+			InRange,
+			Builder.CreateICmpULT(Rot, ConstantInt::get(I64Ty, ClusterTables[Cluster].second)));
+	}
+	return InRange;
+}
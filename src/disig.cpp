@@ -0,0 +1,542 @@
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+
+#include "disig.h"
+
+using namespace llvm;
+
+static const DataLayout *DL = nullptr;
+
+// IR struct name (without the "struct."/"union."/"class." prefix) -> DI
+// definition. nullptr marks names defined more than once inconsistently.
+static StringMap<DICompositeType *> Name2Composite;
+
+static DenseMap<const Function *, DISignature> FuncSigs;
+static DenseMap<const CallBase *, DISignature> ICallSigs;
+
+#define UNKNOWN_TY "?"
+#define VOID_PTR_TY "void*"
+
+static const DIType *
+stripDIType(const DIType *Ty)
+{
+	while (auto *DT = dyn_cast_or_null<DIDerivedType>(Ty))
+	{
+		switch (DT->getTag())
+		{
+		case dwarf::DW_TAG_typedef:
+		case dwarf::DW_TAG_const_type:
+		case dwarf::DW_TAG_volatile_type:
+		case dwarf::DW_TAG_restrict_type:
+		case dwarf::DW_TAG_atomic_type:
+			Ty = DT->getBaseType();
+			continue;
+		default:
+			return Ty;
+		}
+	}
+	return Ty;
+}
+
+static std::string
+canonDIType(const DIType *Ty);
+
+static DISignature
+canonDISubroutine(const DISubroutineType *SubTy)
+{
+	DISignature Sig;
+	auto Types = SubTy->getTypeArray();
+	for (unsigned i = 0; i < Types.size(); i++)
+	{
+		// A null return type is void, a trailing null parameter is `...`
+		if (i > 0 && nullptr == Types[i])
+			Sig.push_back("...");
+		else
+			Sig.push_back(canonDIType(Types[i]));
+	}
+	if (Sig.empty())
+		Sig.push_back("void");
+	return Sig;
+}
+
+// Canonical spelling of a source type. Typedefs and qualifiers are
+// stripped, records are identified by tag and name only.
+static std::string
+canonDIType(const DIType *Ty)
+{
+	if (nullptr == Ty)
+		return "void";
+
+	if (auto *DT = dyn_cast<DIDerivedType>(Ty))
+	{
+		switch (DT->getTag())
+		{
+		case dwarf::DW_TAG_typedef:
+			// `typedef struct { ... } foo_t;` is only known by its typedef
+			if (auto *CT = dyn_cast_or_null<DICompositeType>(stripDIType(DT->getBaseType())))
+				if (CT->getName().empty())
+					return ("typedef " + DT->getName()).str();
+			return canonDIType(DT->getBaseType());
+		case dwarf::DW_TAG_pointer_type:
+			return canonDIType(DT->getBaseType()) + "*";
+		case dwarf::DW_TAG_reference_type:
+			return canonDIType(DT->getBaseType()) + "&";
+		case dwarf::DW_TAG_rvalue_reference_type:
+			return canonDIType(DT->getBaseType()) + "&&";
+		case dwarf::DW_TAG_ptr_to_member_type:
+			return canonDIType(DT->getBaseType()) + " " + canonDIType(DT->getClassType()) + "::*";
+		default:
+			return canonDIType(DT->getBaseType());
+		}
+	}
+
+	if (auto *BT = dyn_cast<DIBasicType>(Ty))
+		return BT->getName().str();
+
+	if (auto *CT = dyn_cast<DICompositeType>(Ty))
+	{
+		if (!CT->getIdentifier().empty())
+			return CT->getIdentifier().str();
+		std::string Name = CT->getName().empty() ? "<anon>" : CT->getName().str();
+		switch (CT->getTag())
+		{
+		case dwarf::DW_TAG_array_type:
+			return canonDIType(CT->getBaseType()) + "[]";
+		case dwarf::DW_TAG_structure_type:
+			return "struct " + Name;
+		case dwarf::DW_TAG_union_type:
+			return "union " + Name;
+		case dwarf::DW_TAG_class_type:
+			return "class " + Name;
+		case dwarf::DW_TAG_enumeration_type:
+			return "enum " + Name;
+		default:
+			return UNKNOWN_TY;
+		}
+	}
+
+	if (auto *SubTy = dyn_cast<DISubroutineType>(Ty))
+	{
+		std::string Str = "fn(";
+		for (auto &&Elem : canonDISubroutine(SubTy))
+			Str += Elem + ",";
+		return Str + ")";
+	}
+
+	return UNKNOWN_TY;
+}
+
+static bool
+isCLanguage(const DICompileUnit *CU)
+{
+	if (nullptr == CU)
+		return false;
+	switch (CU->getSourceLanguage())
+	{
+	case dwarf::DW_LANG_C:
+	case dwarf::DW_LANG_C89:
+	case dwarf::DW_LANG_C99:
+	case dwarf::DW_LANG_C11:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// "struct.ngx_event_s.123" -> "ngx_event_s"
+static StringRef
+getIRRecordName(StructType *STy)
+{
+	if (!STy->hasName())
+		return StringRef();
+	StringRef Name = STy->getName();
+	if (!Name.consume_front("struct.") && !Name.consume_front("union.") && !Name.consume_front("class."))
+		return StringRef();
+	// llvm-link renames clashing types with a numeric suffix
+	auto Dot = Name.rfind('.');
+	if (Dot != StringRef::npos && Dot + 1 < Name.size() &&
+		Name.substr(Dot + 1).find_first_not_of("0123456789") == StringRef::npos)
+		Name = Name.substr(0, Dot);
+	// C++ records carry their scope in IR, but not in the DI name
+	auto Colon = Name.rfind("::");
+	if (Colon != StringRef::npos)
+		Name = Name.substr(Colon + 2);
+	return Name;
+}
+
+// The DI member of CT lying at bit offset OffsetInBits.
+static const DIType *
+getDIMemberAt(const DICompositeType *CT, uint64_t OffsetInBits)
+{
+	// A union is a single IR field, we cannot tell which member is used
+	if (CT->getTag() == dwarf::DW_TAG_union_type)
+		return nullptr;
+	for (auto &&Elem : CT->getElements())
+	{
+		auto *Member = dyn_cast_or_null<DIDerivedType>(Elem);
+		if (nullptr == Member || Member->getTag() != dwarf::DW_TAG_member)
+			continue;
+		if (Member->isBitField() || Member->isStaticMember())
+			continue;
+		if (Member->getOffsetInBits() == OffsetInBits)
+			return Member->getBaseType();
+	}
+	return nullptr;
+}
+
+static const DIType *
+getValueDIType(const Value *Val);
+
+// DI type of the object Ptr points to.
+static const DIType *
+getPointeeDIType(const Value *Ptr)
+{
+	Ptr = Ptr->stripPointerCasts();
+
+	if (auto *AI = dyn_cast<AllocaInst>(Ptr))
+	{
+		auto *LAM = LocalAsMetadata::getIfExists(const_cast<AllocaInst *>(AI));
+		if (nullptr == LAM)
+			return nullptr;
+		auto *MDV = MetadataAsValue::getIfExists(AI->getContext(), LAM);
+		if (nullptr == MDV)
+			return nullptr;
+		for (auto &&U : MDV->users())
+			if (auto *DVI = dyn_cast<DbgVariableIntrinsic>(U))
+				return DVI->getVariable()->getType();
+		return nullptr;
+	}
+
+	if (auto *GV = dyn_cast<GlobalVariable>(Ptr))
+	{
+		SmallVector<DIGlobalVariableExpression *, 1> GVEs;
+		GV->getDebugInfo(GVEs);
+		if (GVEs.empty())
+			return nullptr;
+		return GVEs.front()->getVariable()->getType();
+	}
+
+	if (auto *GEP = dyn_cast<GEPOperator>(Ptr))
+	{
+		Type *CurTy = GEP->getSourceElementType();
+		const DIType *CurDITy = nullptr;
+
+		// Named records are looked up directly, which also covers pointers
+		// we cannot track back to a variable.
+		if (auto *STy = dyn_cast<StructType>(CurTy))
+		{
+			auto It = Name2Composite.find(getIRRecordName(STy));
+			if (It != Name2Composite.end())
+				CurDITy = It->second;
+		}
+		if (nullptr == CurDITy)
+			CurDITy = getPointeeDIType(GEP->getPointerOperand());
+
+		// The first index is pointer arithmetic and keeps the type.
+		for (auto Idx = GEP->idx_begin() + 1; Idx != GEP->idx_end(); ++Idx)
+		{
+			auto *CT = dyn_cast_or_null<DICompositeType>(stripDIType(CurDITy));
+			if (nullptr == CT)
+				return nullptr;
+
+			if (auto *STy = dyn_cast<StructType>(CurTy))
+			{
+				auto *FieldNo = dyn_cast<ConstantInt>(*Idx);
+				if (nullptr == FieldNo || nullptr == DL)
+					return nullptr;
+				auto Offset = DL->getStructLayout(STy)->getElementOffsetInBits(FieldNo->getZExtValue());
+				CurDITy = getDIMemberAt(CT, Offset);
+				CurTy = STy->getElementType(FieldNo->getZExtValue());
+				continue;
+			}
+			if (auto *ATy = dyn_cast<ArrayType>(CurTy))
+			{
+				if (CT->getTag() != dwarf::DW_TAG_array_type)
+					return nullptr;
+				CurDITy = CT->getBaseType();
+				CurTy = ATy->getElementType();
+				continue;
+			}
+			return nullptr;
+		}
+		return CurDITy;
+	}
+
+	// *p where p is itself a value of pointer type
+	auto *PtrDITy = dyn_cast_or_null<DIDerivedType>(stripDIType(getValueDIType(Ptr)));
+	if (nullptr != PtrDITy && PtrDITy->getTag() == dwarf::DW_TAG_pointer_type)
+		return PtrDITy->getBaseType();
+	return nullptr;
+}
+
+// DI type of the SSA value Val.
+static const DIType *
+getValueDIType(const Value *Val)
+{
+	if (auto *LI = dyn_cast<LoadInst>(Val))
+	{
+		auto *Ty = getPointeeDIType(LI->getPointerOperand());
+		// A load through a bitcast of a record pointer reads its first field
+		while (auto *CT = dyn_cast_or_null<DICompositeType>(stripDIType(Ty)))
+		{
+			if (CT->getTag() != dwarf::DW_TAG_structure_type && CT->getTag() != dwarf::DW_TAG_class_type)
+				break;
+			Ty = getDIMemberAt(CT, 0);
+		}
+		return Ty;
+	}
+
+	if (auto *Arg = dyn_cast<Argument>(Val))
+	{
+		auto *SP = Arg->getParent()->getSubprogram();
+		if (nullptr == SP || nullptr == SP->getType())
+			return nullptr;
+		auto Types = SP->getType()->getTypeArray();
+		if (Arg->getArgNo() + 1 >= Types.size())
+			return nullptr;
+		return Types[Arg->getArgNo() + 1];
+	}
+
+	if (auto *CB = dyn_cast<CallBase>(Val))
+	{
+		auto *Callee = CB->getCalledFunction();
+		if (nullptr == Callee || nullptr == Callee->getSubprogram())
+			return nullptr;
+		auto *SubTy = Callee->getSubprogram()->getType();
+		if (nullptr == SubTy || SubTy->getTypeArray().size() == 0)
+			return nullptr;
+		return SubTy->getTypeArray()[0];
+	}
+
+	if (auto *PN = dyn_cast<PHINode>(Val))
+	{
+		for (auto &&InComingVal : PN->incoming_values())
+			if (!isa<PHINode>(InComingVal))
+				if (auto *Ty = getValueDIType(InComingVal->stripPointerCasts()))
+					return Ty;
+		return nullptr;
+	}
+
+	if (auto *SI = dyn_cast<SelectInst>(Val))
+	{
+		if (auto *Ty = getValueDIType(SI->getTrueValue()->stripPointerCasts()))
+			return Ty;
+		return getValueDIType(SI->getFalseValue()->stripPointerCasts());
+	}
+
+	return nullptr;
+}
+
+void initDISignatures(Module &M)
+{
+	DL = &M.getDataLayout();
+	Name2Composite.clear();
+	FuncSigs.clear();
+	ICallSigs.clear();
+
+	DebugInfoFinder Finder;
+	Finder.processModule(M);
+	for (auto &&Ty : Finder.types())
+	{
+		auto *CT = dyn_cast<DICompositeType>(Ty);
+		if (nullptr == CT || CT->getName().empty() || CT->isForwardDecl())
+			continue;
+		if (CT->getTag() != dwarf::DW_TAG_structure_type &&
+			CT->getTag() != dwarf::DW_TAG_union_type &&
+			CT->getTag() != dwarf::DW_TAG_class_type)
+			continue;
+
+		auto It = Name2Composite.find(CT->getName());
+		if (It == Name2Composite.end())
+		{
+			Name2Composite[CT->getName()] = CT;
+			continue;
+		}
+		// Same name, different layout: we cannot pick one.
+		if (nullptr != It->second &&
+			(It->second->getSizeInBits() != CT->getSizeInBits() ||
+			 It->second->getElements().size() != CT->getElements().size()))
+			It->second = nullptr;
+	}
+}
+
+// The DI type of the slot at bit Offset of an object of type Ty, down to
+// a non-record type.
+static const DIType *
+getDITypeAt(const DIType *Ty, uint64_t Offset)
+{
+	while (auto *CT = dyn_cast_or_null<DICompositeType>(stripDIType(Ty)))
+	{
+		if (CT->getTag() == dwarf::DW_TAG_array_type)
+		{
+			auto ElemBits = nullptr == stripDIType(CT->getBaseType()) ? 0 : stripDIType(CT->getBaseType())->getSizeInBits();
+			if (0 == ElemBits)
+				return nullptr;
+			Offset %= ElemBits;
+			Ty = CT->getBaseType();
+			continue;
+		}
+		if (CT->getTag() != dwarf::DW_TAG_structure_type && CT->getTag() != dwarf::DW_TAG_class_type)
+			return nullptr;
+		const DIDerivedType *Slot = nullptr;
+		for (auto &&Elem : CT->getElements())
+		{
+			auto *Member = dyn_cast_or_null<DIDerivedType>(Elem);
+			if (nullptr == Member || Member->getTag() != dwarf::DW_TAG_member || Member->isStaticMember())
+				continue;
+			if (Member->getOffsetInBits() <= Offset && Offset < Member->getOffsetInBits() + Member->getSizeInBits())
+				Slot = Member;
+		}
+		if (nullptr == Slot)
+			return nullptr;
+		Offset -= Slot->getOffsetInBits();
+		Ty = Slot->getBaseType();
+	}
+	return 0 == Offset ? Ty : nullptr;
+}
+
+// Collect into Slots the DI types of the places C is stored in, by store
+// instructions or in global initializers; C lies at bit Offset of the
+// value originally asked about.
+static void
+getStoreSlotDITypes(const Constant *C, uint64_t Offset, SmallVectorImpl<const DIType *> &Slots)
+{
+	for (auto &&U : C->uses())
+	{
+		auto *User = U.getUser();
+		if (auto *SI = dyn_cast<StoreInst>(User))
+		{
+			if (SI->getValueOperand() == C)
+				Slots.push_back(getPointeeDIType(SI->getPointerOperand()));
+			continue;
+		}
+		if (auto *GV = dyn_cast<GlobalVariable>(User))
+		{
+			if (GV->hasInitializer() && GV->getInitializer() == C)
+				Slots.push_back(getDITypeAt(getPointeeDIType(GV), Offset));
+			continue;
+		}
+		if (nullptr == DL)
+			continue;
+		if (auto *CS = dyn_cast<ConstantStruct>(User))
+			getStoreSlotDITypes(CS, Offset + DL->getStructLayout(CS->getType())->getElementOffsetInBits(U.getOperandNo()), Slots);
+		else if (auto *CA = dyn_cast<ConstantArray>(User))
+			getStoreSlotDITypes(CA, Offset + U.getOperandNo() * DL->getTypeAllocSizeInBits(CA->getType()->getElementType()), Slots);
+		else if (auto *CE = dyn_cast<ConstantExpr>(User))
+		{
+			if (CE->isCast())
+				getStoreSlotDITypes(CE, Offset, Slots);
+		}
+	}
+}
+
+// A function whose address is cast to another function type is called
+// through pointers of that type, so its own signature tells nothing.
+// Opaque pointers hide the cast: look at the calls made with another type,
+// and at the source type of the slots the function is stored in.
+static bool
+isCastToOtherFuncTy(const Function *Func, const DISignature &Sig)
+{
+	for (auto &&U : Func->users())
+	{
+		auto *Call = dyn_cast<CallBase>(U);
+		if (nullptr != Call && Call->getCalledOperand() == Func &&
+			Call->getFunctionType() != Func->getFunctionType())
+			return true;
+		auto *CE = dyn_cast<ConstantExpr>(U);
+		if (nullptr == CE || !CE->isCast())
+			continue;
+		auto *PtrTy = dyn_cast<PointerType>(CE->getType());
+		if (nullptr != PtrTy && !PtrTy->isOpaqueOrPointeeTypeMatches(Func->getFunctionType()))
+			return true;
+	}
+
+	SmallVector<const DIType *, 4> Slots;
+	getStoreSlotDITypes(Func, 0, Slots);
+	for (auto &&Slot : Slots)
+	{
+		auto *PtrTy = dyn_cast_or_null<DIDerivedType>(stripDIType(Slot));
+		if (nullptr == PtrTy || PtrTy->getTag() != dwarf::DW_TAG_pointer_type)
+			continue;
+		auto *SubTy = dyn_cast_or_null<DISubroutineType>(stripDIType(PtrTy->getBaseType()));
+		if (nullptr != SubTy && !isDISigCompatible(canonDISubroutine(SubTy), Sig))
+			return true;
+	}
+	return false;
+}
+
+const DISignature &
+getFuncDISignature(const Function *Func)
+{
+	auto It = FuncSigs.find(Func);
+	if (It != FuncSigs.end())
+		return It->second;
+
+	DISignature Sig;
+	auto *SP = Func->getSubprogram();
+	// K&R definitions have no parameter types to compare
+	if (nullptr != SP && nullptr != SP->getType() &&
+		((SP->getFlags() & DINode::FlagPrototyped) || !isCLanguage(SP->getUnit())))
+	{
+		Sig = canonDISubroutine(SP->getType());
+		if (isCastToOtherFuncTy(Func, Sig))
+			Sig.clear();
+	}
+	return FuncSigs[Func] = Sig;
+}
+
+const DISignature &
+getICallDISignature(const CallBase *ICall)
+{
+	auto It = ICallSigs.find(ICall);
+	if (It != ICallSigs.end())
+		return It->second;
+
+	DISignature Sig;
+	auto *PtrTy = dyn_cast_or_null<DIDerivedType>(
+		stripDIType(getValueDIType(ICall->getCalledOperand()->stripPointerCasts())));
+	auto *SP = ICall->getFunction()->getSubprogram();
+	if (nullptr != PtrTy && PtrTy->getTag() == dwarf::DW_TAG_pointer_type)
+		if (auto *SubTy = dyn_cast_or_null<DISubroutineType>(stripDIType(PtrTy->getBaseType())))
+		{
+			// `void (*fp)()` may point to a function with any parameters.
+			// Clang only flags prototyped subprograms, an unprototyped
+			// type is its return type and an unspecified parameter.
+			auto Types = SubTy->getTypeArray();
+			bool Prototyped = (SubTy->getFlags() & DINode::FlagPrototyped) ||
+							  !(2 == Types.size() && nullptr == Types[1]);
+			if (Prototyped || (nullptr != SP && !isCLanguage(SP->getUnit())))
+				Sig = canonDISubroutine(SubTy);
+		}
+	return ICallSigs[ICall] = Sig;
+}
+
+static bool
+isDITypeCompatible(const std::string &Left, const std::string &Right)
+{
+	if (Left == Right || Left == UNKNOWN_TY || Right == UNKNOWN_TY)
+		return true;
+	// Generic pointers hold anything, as C allows without a cast
+	if (Left == VOID_PTR_TY)
+		return Right.back() == '*';
+	if (Right == VOID_PTR_TY)
+		return Left.back() == '*';
+	return false;
+}
+
+bool isDISigCompatible(const DISignature &ICall, const DISignature &Func)
+{
+	if (ICall.empty() || Func.empty())
+		return true;
+	if (ICall.size() != Func.size())
+		return false;
+	for (unsigned i = 0; i < ICall.size(); i++)
+	{
+		if (!isDITypeCompatible(ICall[i], Func[i]))
+			return false;
+	}
+	return true;
+}
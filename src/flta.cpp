@@ -1,11 +1,38 @@
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "flta.h"
+#include "castflow.h"
+#include "cbmodel.h"
+#include "cluster.h"
+#include "disig.h"
+#include "icache.h"
+#include "jumptable.h"
+#include "perfhash.h"
+#include "prefixtag.h"
+#include "rtcalls.h"
+#include "sample.h"
+#include "simdset.h"
+#include "sortedset.h"
 #include "utils.h"
+#include "vcall.h"
+#include "vprof.h"
+
+#include <map>
 
 using namespace llvm;
 
@@ -26,6 +53,166 @@ static void
 printIDMapResult(raw_ostream &OutS, const llvm::DenseMap<uint64_t, std::vector<uint64_t>> ICallID2FuncID);
 #endif
 
+// Options only take effect if the plugin is also loaded with `-load`,
+// see README.md.
+static cl::opt<bool> UseDISig(
+	"flta-debuginfo-sig",
+	cl::desc("Split FLTA target sets with source-level signatures from debug info"),
+	cl::init(false));
+
+static cl::opt<bool> UseCastFlow(
+	"flta-cast-flow",
+	cl::desc("Narrow matches on generic pointer parameters with the types cast into them"),
+	cl::init(false));
+
+static cl::opt<bool> UseCallbackModels(
+	"flta-callback-models",
+	cl::desc("Keep functions only passed to library callback APIs (qsort, signal, ...) out of target sets"),
+	cl::init(false));
+
+enum CheckKind
+{
+	CHECK_LINEAR,
+	CHECK_INLINE,
+	CHECK_JUMPTABLE,
+	CHECK_CLUSTER,
+	CHECK_PREFIX,
+	CHECK_BSEARCH,
+	CHECK_MPH,
+	CHECK_SIMD,
+	CHECK_RUNTIME,
+};
+
+static cl::opt<CheckKind> CheckMode(
+	"flta-check",
+	cl::desc("How an icall is checked against its targets"),
+	cl::values(
+		clEnumValN(CHECK_LINEAR, "linear", "Call __cfi_icall_checker once per target (default)"),
+		clEnumValN(CHECK_INLINE, "inline", "Compare inline, exit on the first match"),
+		clEnumValN(CHECK_JUMPTABLE, "jumptable", "Reach targets through a jump table, test a bitset"),
+		clEnumValN(CHECK_CLUSTER, "cluster", "Give each target class a table of stubs, test its address range"),
+		clEnumValN(CHECK_PREFIX, "prefix", "Tag each target class in prefix data, test the tag before the callee"),
+		clEnumValN(CHECK_BSEARCH, "bsearch", "Binary-search large sets sorted at startup, compare small ones inline"),
+		clEnumValN(CHECK_MPH, "mph", "Look large sets up in perfect hash tables built at startup, compare small ones inline"),
+		clEnumValN(CHECK_SIMD, "simd", "Scan medium sets with vector compares, compare the others inline"),
+		clEnumValN(CHECK_RUNTIME, "runtime", "Ask cfi_rt, which picks a checker per set size (implies -flta-runtime)")),
+	cl::init(CHECK_LINEAR));
+
+static cl::opt<unsigned> BSearchThreshold(
+	"flta-bsearch-threshold",
+	cl::desc("Smallest target set checked with a binary search"),
+	cl::init(16));
+
+static cl::opt<unsigned> MPHThreshold(
+	"flta-mph-threshold",
+	cl::desc("Smallest target set checked with a perfect hash table"),
+	cl::init(16));
+
+static cl::opt<unsigned> SIMDMin(
+	"flta-simd-min",
+	cl::desc("Smallest target set checked with vector compares"),
+	cl::init(8));
+
+static cl::opt<unsigned> SIMDMax(
+	"flta-simd-max",
+	cl::desc("Largest target set checked with vector compares"),
+	cl::init(64));
+
+static cl::opt<unsigned> ClusterAlign(
+	"flta-cluster-align",
+	cl::desc("Size of a stub slot inside a cluster (power of 2, at least 8)"),
+	cl::init(16));
+
+static cl::opt<unsigned> PromoteMax(
+	"flta-promote",
+	cl::desc("Turn icalls with at most this many targets into compares and direct calls"),
+	cl::init(0));
+
+static cl::opt<bool> UseProfile(
+	"flta-profile",
+	cl::desc("Order the compares of each icall by its indirect-call value profile"),
+	cl::init(false));
+
+static cl::opt<unsigned> HotCoverage(
+	"flta-hot-coverage",
+	cl::desc("Percentage of profiled calls the fast path of an icall has to cover"),
+	cl::init(99));
+
+static cl::opt<bool> UseICache(
+	"flta-icache",
+	cl::desc("Cache the last valid target of each icall, run the full check on misses"),
+	cl::init(false));
+
+static cl::opt<bool> ICacheStats(
+	"flta-icache-stats",
+	cl::desc("Count icall cache hits and misses, print them at exit"),
+	cl::init(false));
+
+static cl::opt<unsigned> SampleRate(
+	"flta-sample-rate",
+	cl::desc("Run the full check once every N executions of each icall (1: always)"),
+	cl::init(1));
+
+static cl::list<std::string> SampleFuncRates(
+	"flta-sample-func",
+	cl::desc("Sample rate of the icalls of a function, <function>=<N>"),
+	cl::CommaSeparated);
+
+static cl::list<std::string> SampleSiteRates(
+	"flta-sample-site",
+	cl::desc("Sample rate of one icall, <icall ID>=<N>"),
+	cl::CommaSeparated);
+
+static cl::opt<bool> UseRuntime(
+	"flta-runtime",
+	cl::desc("Call the checker and report of the cfi_rt library instead of synthesizing them"),
+	cl::init(false));
+
+static cl::opt<bool> UseRelTables(
+	"flta-relative-tables",
+	cl::desc("Emit the function address array as 32-bit offsets from the array"),
+	cl::init(false));
+
+static cl::opt<bool> UseLateLower(
+	"flta-late-lower",
+	cl::desc("Emit checks as __cfi_membership tests, expanded by the flta-lower pass"),
+	cl::init(false));
+
+static cl::opt<bool> UseHoist(
+	"flta-hoist",
+	cl::desc("Check loop-invariant callees once, before the loop"),
+	cl::init(true));
+
+static cl::opt<bool> UseStaticProof(
+	"flta-prove-static",
+	cl::desc("Skip the check of icalls whose callees are known at compile time to be allowed"),
+	cl::init(true));
+
+static cl::opt<bool> UseDomElim(
+	"flta-dom-elim",
+	cl::desc("Skip the check of icalls dominated by a check of the same pointer"),
+	cl::init(true));
+
+static cl::opt<bool> PrintStats(
+	"flta-stats",
+	cl::desc("Print instrumentation statistics to stderr"),
+	cl::init(false));
+
+static cl::opt<bool> UseVCall(
+	"flta-vcall",
+	cl::desc("Check C++ virtual calls against the class hierarchy from !type metadata"),
+	cl::init(false));
+
+static cl::opt<bool> LogOnly(
+	"flta-log-only",
+	cl::desc("Count violations per site in the shared memory of cfi_rt and go on with the call, instead of aborting"),
+	cl::init(false));
+
+static cl::opt<bool> LogCalls(
+	"flta-log-calls",
+	cl::desc("Count the calls of each icall site in the shared memory of cfi_rt too"),
+	cl::init(false));
+
 static std::vector<CallBase *> ICalls;
 static std::vector<FunctionType *> ICallTypes;
 
@@ -37,36 +224,56 @@ static llvm::DenseMap<FunctionType *, std::vector<Function *>> Type2Funcs; /* Th
 
 // Initialized via makeFuncAddrArray()
 static std::vector<Constant *> FuncAddrs;
-// Initialized via makeICallAddrArray
-// ICallAddr means the address of such asm snippets: 
-// ----------    
-//     mov 0x0, %arg1
-//     mov 0x1, %arg2
-//     call %eax
-// ----------
-// We cannot accurately get the address of `call eax` instruction, 
-// because We are at the IR level, not the MIR level.
-static std::vector<Constant *> ICallAddrs;
+
+// Number of functions placed in each cluster or tagged with each class
+static std::vector<unsigned> ClassSizes;
+
+// Most frequent targets of each icall, checked first. Profiled icalls only
+#define HOT_TARGETS_MAX 4
+static llvm::DenseMap<uint64_t, std::vector<uint64_t>> ICallID2HotFuncID;
+
+// Set of each icall in the table-based modes (sorted, perfect hash,
+// vector or cfi_rt), large sets only
+static llvm::DenseMap<uint64_t, unsigned> ICallID2SetID;
 
 #define FUNC_ADDRS_SYMBOL   "__cfi_func_addr_array"
 #define FUNC_ADDRS_LEN      FuncAddrs.size()
 
-#define ICALL_ADDRS_SYMBOL  "__cfi_icall_addr_array"
-#define ICALL_ADDRS_LEN     ICallAddrs.size()
+// Records {i32 site - record, i32 icall ID} emitted by makeICallSites,
+// bounded by __start_/__stop___cfi_icall_sites
+#define ICALL_SITES_SECTION "__cfi_icall_sites"
 
-#define FUNC_ADDRS_SECTION  ".__cfi_func_addrs"
-#define ICALL_ADDRS_SECTION ".__cfi_icall_addrs"
+// -flta-relative-tables: [N x i32] offsets from the array instead
+#define FUNC_RELS_SYMBOL    "__cfi_func_rel_array"
+
+// Read-only once relocated (RELRO)
+#define FUNC_ADDRS_SECTION  ".data.rel.ro.cfi_func_addrs"
+#define FUNC_RELS_SECTION   ".data.rel.ro.cfi_func_rels"
 
 #define LOOP_PRINTER "__cfi_loop_printer"
-enum PRINTEE {FUNC_ADDRS, ICALL_ADDRS};
+enum PRINTEE {FUNC_ADDRS};
 
 #define ICALL_CHECKER "__cfi_icall_checker"
+#define VIOLATION_HANDLER "__cfi_violation"
+// Site ID of the calls with no __cfi_icall_sites record (promoted, virtual)
+#define NO_SITE -1
+// Weight of the passing side of a check against its failing one
+#define PASS_WEIGHT 2000
+#define ICALL_REL_CHECKER "__cfi_icall_rel_checker"
+
+// -flta-late-lower: i1 (i64 icall ID, i8 *callee), expanded by flta-lower
+#define MEMBERSHIP "__cfi_membership"
 
 // Containing the map from the ICall ID to Func ID.
 // ICall ID is the ICalladdr, Func ID is the FuncAddrs.
 // We assume that the order of these addrs keeps consistant.
 static llvm::DenseMap<uint64_t, std::vector<uint64_t>> ICallID2FuncID;
 
+// Site ID of each icall: its ICall ID before any icall was dropped, so site
+// records, reports, sample rates and log counters keep their numbers.
+static std::vector<uint64_t> ICallSiteIDs;
+static uint64_t NumICallSites = 0;
+
 #define VoidTy Type::getVoidTy(M.getContext())
 #define I1Ty Type::getInt1Ty(M.getContext())
 #define I32Ty Type::getInt32Ty(M.getContext())
@@ -89,6 +296,11 @@ createType2FuncMapping()
 			{
 				Funcs.push_back(Func);
 			}
+			// Handlers stored through a cast are called with the cast type
+			else if (UseCastFlow && is_contained(getCastFuncTys(Func), Type))
+			{
+				Funcs.push_back(Func);
+			}
 		}
 		if (Type2Funcs.find(Type) == Type2Funcs.end())
 		{
@@ -102,13 +314,26 @@ static std::vector<Function *>
 resolveICallTarget(CallBase *ICall)
 {
 	std::vector<Function *> Targets;
+	SmallPtrSet<Function *, 16> Seen;
 	Targets.clear();
 	for (auto &Elem : Type2Funcs)
 	{
 
-		if (isIdenticalType(ICall->getFunctionType(), Elem.first))
+		if (!isIdenticalType(ICall->getFunctionType(), Elem.first))
+			continue;
+
+		for (auto &&Func : Elem.second)
 		{
-			Targets.insert(std::end(Targets), std::begin(Elem.second), std::end(Elem.second));
+			// IR types say nothing once pointers are opaque, the source does
+			if (UseDISig && !isDISigCompatible(getICallDISignature(ICall), getFuncDISignature(Func)))
+				continue;
+			// i8*, {}* and opaque pointers match anything, the casts do not
+			if (UseCastFlow && !isCastFlowCompatible(ICall, Func))
+				continue;
+			// With cast types a function may be in several classes
+			if (!Seen.insert(Func).second)
+				continue;
+			Targets.push_back(Func);
 		}
 	}
 
@@ -120,10 +345,20 @@ analysis(Module &M)
 {
 	for (auto &Func : M)
 	{
-		if (Func.hasAddressTaken())
+		// Only libc calls it back, no icall in the program can reach it
+		if (UseCallbackModels && isLibraryOnlyCallback(&Func))
+		{
+			LOG_STR("FLTA: library-only callback " << Func.getName());
+		}
+		else if (Func.hasAddressTaken())
 		{
 			AddrTakenFuncs.push_back(&Func);
 			AddrTakenFuncTypes.push_back(Func.getFunctionType());
+			if (UseCastFlow)
+			{
+				for (auto &&CastTy : getCastFuncTys(&Func))
+					AddrTakenFuncTypes.push_back(CastTy);
+			}
 		}
 
 		for (auto &BB : Func)
@@ -133,6 +368,9 @@ analysis(Module &M)
 				auto *CB = dyn_cast<CallBase>(&Inst);
 				if (nullptr != CB && CB->isIndirectCall())
 				{
+					// Virtual calls get a vtable check instead
+					if (UseVCall && isVCall(CB))
+						continue;
 					ICalls.push_back(CB);
 					ICallTypes.push_back(CB->getFunctionType());
 					// CB->getCalledOperand()->print(llvm::errs());
@@ -142,41 +380,92 @@ analysis(Module &M)
 	}
 }
 
-// Make ICallAddrArray -> [i8* X N]
-// an array contains the address of ICalls
-// N is determined in compile time
+// Whether Addr can be stored as a 32-bit offset from our tables: it is in
+// this module's image. Functions of other DSOs (or preemptible ones) can be
+// anywhere, their entry is 0 and they are compared directly.
+static bool
+isRelEncodable(Constant *Addr)
+{
+	auto Func = dyn_cast<Function>(Addr->stripPointerCasts());
+	if (nullptr == Func)
+		return true;
+	return !Func->isDeclaration() && (Func->hasLocalLinkage() || Func->isDSOLocal());
+}
+
+// The tables are never written: constant, so the optimizer folds the loads
+// of known entries, and in read-only sections so they cannot be tampered
+// with. Internal unless cfi_rt looks them up by name; kept even when the
+// checks no longer load them. Other formats than ELF keep the default
+// section of a constant, as read-only once relocated.
+static void
+protectTable(Module &M, GlobalVariable *Table, StringRef Section)
+{
+	Table->setConstant(true);
+	if (Triple(M.getTargetTriple()).isOSBinFormatELF())
+		Table->setSection(Section);
+	if (!UseRuntime)
+		Table->setLinkage(GlobalValue::InternalLinkage);
+	appendToCompilerUsed(M, {Table});
+}
+
+// Make a [i32 X N] array of Addrs relative to the array itself: link-time
+// constants, so no dynamic relocation, and half the size.
 static GlobalVariable *
-makeICallAddrArray(Module &M)
+makeRelArray(Module &M, StringRef Name, const std::vector<Constant *> &Addrs, StringRef Section)
 {
-	GlobalVariable *ICallAddrArray = M.getNamedGlobal(ICALL_ADDRS_SYMBOL);
-	if (nullptr != ICallAddrArray)
-		return ICallAddrArray;
-	/* Break BB into two pieces. */
-	/* ICall is always at the front of the BB*/
-	for (auto &&ICall : ICalls)
+	ArrayType *RelArrayTy = ArrayType::get(I32Ty, Addrs.size());
+	auto RelArray = new GlobalVariable(
+		M, RelArrayTy, true, GlobalValue::ExternalLinkage, nullptr, Name);
+	auto Base = ConstantExpr::getPtrToInt(RelArray, I64Ty);
+	std::vector<Constant *> Offsets;
+	for (auto &&Addr : Addrs)
 	{
-
-		ICallAddrs.push_back(
-			BlockAddress::get(
-				ICall->getParent()->splitBasicBlock(
-					ICall,
-					".icall")));
+		if (!isRelEncodable(Addr))
+		{
+			Offsets.push_back(ConstantInt::get(I32Ty, 0));
+			continue;
+		}
+		Offsets.push_back(
+			ConstantExpr::getTrunc(
+				ConstantExpr::getSub(ConstantExpr::getPtrToInt(Addr, I64Ty), Base),
+				I32Ty));
 	}
+	RelArray->setInitializer(ConstantArray::get(RelArrayTy, Offsets));
+	protectTable(M, RelArray, Section);
+	return RelArray;
+}
 
-	ArrayType *ICallAddrArrayTy = ArrayType::get(
-		I8PtrTy,
-		ICALL_ADDRS_LEN);
-	M.getOrInsertGlobal(ICALL_ADDRS_SYMBOL, ICallAddrArrayTy);
-	ICallAddrArray = M.getNamedGlobal(ICALL_ADDRS_SYMBOL);
-	ICallAddrArray->setLinkage(GlobalValue::ExternalLinkage);
-	ICallAddrArray->setInitializer(
-		ConstantArray::get(
-			ArrayType::get(
-				I8PtrTy,
-				ICALL_ADDRS_LEN),
-			llvm::makeArrayRef(ICallAddrs)));
-	ICallAddrArray->setSection(ICALL_ADDRS_SECTION);
-	return ICallAddrArray;
+// Record each icall in ICALL_SITES_SECTION, with a label placed by an
+// inline asm right before the call in IR. Instruction selection still
+// emits the argument setup after the label, so a record points at the
+// start of the call sequence: the icall is the first call at or after it.
+// Run after the checks are inserted; the IR is left as is, so it optimizes
+// like the original, and the records follow the call wherever codegen
+// moves or duplicates it.
+// ELF only: the records rely on its section directives and __start_/__stop_.
+static void
+makeICallSites(Module &M)
+{
+	if (!Triple(M.getTargetTriple()).isOSBinFormatELF())
+		return;
+	auto AsmTy = FunctionType::get(VoidTy, false);
+	uint64_t Counter = 0;
+	for (auto &&ICall : ICalls)
+	{
+		auto SiteID = ICallSiteIDs[Counter++];
+		// Offsets from the record: resolved at link time, read-only
+		std::string Asm =
+			"${:private}cfi_site${:uid}:\n"
+			// %progbits, `@` starts a comment on ARM
+			"\t.pushsection " ICALL_SITES_SECTION ",\"a\",%progbits\n"
+			"\t.balign 4\n"
+			"\t.long ${:private}cfi_site${:uid} - .\n"
+			"\t.long " + std::to_string(SiteID) + "\n"
+			"\t.popsection";
+		auto Site = CallInst::Create(InlineAsm::get(AsmTy, Asm, "", true), "", ICall);
+		Site->addFnAttr(Attribute::NoUnwind);
+		Site->addFnAttr(Attribute::InaccessibleMemOnly);
+	}
 }
 
 // Make FuncAddrArray -> [i8* X N]
@@ -197,6 +486,8 @@ makeFuncAddrArray(Module &M)
 				Func,
 				I8PtrTy));
 	}
+	if (UseRelTables)
+		return makeRelArray(M, FUNC_RELS_SYMBOL, FuncAddrs, FUNC_RELS_SECTION);
 
 	ArrayType *FuncAddrArrayTy = ArrayType::get(
 		I8PtrTy,
@@ -210,7 +501,7 @@ makeFuncAddrArray(Module &M)
 				I8PtrTy,
 				FUNC_ADDRS_LEN),
 			llvm::makeArrayRef(FuncAddrs)));
-	FuncAddrArray->setSection(FUNC_ADDRS_SECTION);
+	protectTable(M, FuncAddrArray, FUNC_ADDRS_SECTION);
 	return FuncAddrArray;
 }
 
@@ -243,6 +534,7 @@ CreateICallID2FuncIDMapping()
 {
 	uint64_t ICallIDCounter = 0;
 
+	ICallSiteIDs.clear();
 	for (auto &&ICall : ICalls)
 	{
 		auto FuncIDs = getFuncIDList(resolveICallTarget(ICall));
@@ -250,8 +542,50 @@ CreateICallID2FuncIDMapping()
 			std::pair<uint64_t, std::vector<uint64_t>>(
 				ICallIDCounter,
 				FuncIDs));
+		ICallSiteIDs.push_back(ICallIDCounter);
 		ICallIDCounter++;
 	}
+	NumICallSites = ICalls.size();
+}
+
+// Move the targets each icall calls most often to the front of its list,
+// and keep up to HOT_TARGETS_MAX of them as a fast path when together
+// they cover HotCoverage percent of its calls.
+static void
+orderICallTargetsByProfile()
+{
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+	{
+		uint64_t Total = 0;
+		auto Profile = getICallProfile(ICalls[ICallID], Total);
+		auto &Targets = ICallID2FuncID[ICallID];
+		std::vector<uint64_t> Ordered;
+		uint64_t Covered = 0;
+		bool Hot = false;
+		for (auto &&Elem : Profile)
+		{
+			// Stale profile, or a callback left out of the sets
+			if (!is_contained(AddrTakenFuncs, Elem.first))
+				continue;
+			auto It = std::find(Targets.begin(), Targets.end(), getFuncID(Elem.first));
+			// Outside the set: the profile run violated, or FLTA missed it
+			if (It == Targets.end() || is_contained(Ordered, *It))
+				continue;
+			Ordered.push_back(*It);
+			Covered += Elem.second;
+			if (!Hot && Ordered.size() <= HOT_TARGETS_MAX && Covered * 100 >= Total * HotCoverage)
+			{
+				ICallID2HotFuncID[ICallID] = Ordered;
+				Hot = true;
+			}
+		}
+		if (Ordered.empty())
+			continue;
+		for (auto &&TargetID : Targets)
+			if (!is_contained(Ordered, TargetID))
+				Ordered.push_back(TargetID);
+		Targets = Ordered;
+	}
 }
 
 //////////////////////////// INSTRUMENTATION /////////////////////////////////
@@ -261,6 +595,11 @@ CreateICallID2FuncIDMapping()
 static Function *
 makeLoopPrinter(Module &M)
 {
+	// cfi_rt has one
+	if (UseRuntime)
+		return cast<Function>(
+			M.getOrInsertFunction(RT_PRINT_ADDRS, VoidTy, I64PtrTy, I32Ty).getCallee());
+
 	// check if we had make LoopPrinter earlier.
 	auto Func = M.getFunction(LOOP_PRINTER);
 	if (nullptr != Func)
@@ -385,16 +724,6 @@ makeLoopPrinterInstrument(Module &M, StringRef FName, enum PRINTEE Printee)
 						I32Ty,
 						FUNC_ADDRS_LEN));
 		break;
-	case ICALL_ADDRS:
-		GV = M.getGlobalVariable(ICALL_ADDRS_SYMBOL, true);
-		BitCast = Builder.CreateBitCast(
-						GV,
-						I64PtrTy);
-		CalleeArgs.push_back(BitCast);
-		CalleeArgs.push_back(ConstantInt::get(
-						I32Ty,
-						ICALL_ADDRS_LEN));
-		break;
 	default:
 		llvm_unreachable("Printee is invalid!");
 		break;
@@ -407,13 +736,20 @@ makeLoopPrinterInstrument(Module &M, StringRef FName, enum PRINTEE Printee)
 static Function *
 makeICallChecker(Module &M)
 {
+	auto Name = UseRelTables ? ICALL_REL_CHECKER : ICALL_CHECKER;
 	// check if we had make ICallChecker earlier.
-	auto Func = M.getFunction(ICALL_CHECKER);
+	auto Func = M.getFunction(Name);
 	if (nullptr != Func)
 	{
 		return Func;
 	}
 
+	// cfi_rt defines it
+	if (UseRuntime)
+		return Function::Create(
+			FunctionType::get(I32Ty, {I64Ty, I64Ty}, false),
+			Function::ExternalLinkage, Name, M);
+
 	/*(i64, i8*)*/
 	std::vector<Type *> ArgTys;
 	ArgTys.push_back(I64Ty);
@@ -423,11 +759,14 @@ makeICallChecker(Module &M)
 	FunctionType *FuncTy = FunctionType::get(
 		I32Ty,
 		ArgTys, false);
+	// Inlined into each check, where func_id is a constant and the load
+	// from the constant table folds away
 	Func = Function::Create(
 		FuncTy,
-		Function::ExternalLinkage,
-		ICALL_CHECKER,
+		Function::InternalLinkage,
+		Name,
 		M);
+	Func->addFnAttr(Attribute::AlwaysInline);
 
 	// prepare the args' names
 	auto Args = Func->arg_begin();
@@ -453,11 +792,25 @@ makeICallChecker(Module &M)
 
 	auto FunID = Builder.CreateLoad(I64Ty, FunIDAddr);
 
-	auto FunAddrArray = M.getNamedGlobal(FUNC_ADDRS_SYMBOL);
-	auto BitCast = Builder.CreateBitCast(FunAddrArray, I64PtrTy);
-	auto GEP = Builder.CreateGEP(I64Ty, BitCast, FunID);
-	  
-	auto ExpectedTarget = Builder.CreateLoad(I64Ty, GEP);	
+	Value *ExpectedTarget = nullptr;
+	if (UseRelTables)
+	{
+		// array + sext(array[func_id])
+		auto FunRelArray = M.getNamedGlobal(FUNC_RELS_SYMBOL);
+		auto BitCast = Builder.CreateBitCast(FunRelArray, I32PtrTy);
+		auto GEP = Builder.CreateGEP(I32Ty, BitCast, FunID);
+		auto Offset = Builder.CreateSExt(Builder.CreateLoad(I32Ty, GEP), I64Ty);
+		ExpectedTarget = Builder.CreateAdd(
+			Builder.CreatePtrToInt(FunRelArray, I64Ty),
+			Offset);
+	}
+	else
+	{
+		auto FunAddrArray = M.getNamedGlobal(FUNC_ADDRS_SYMBOL);
+		auto BitCast = Builder.CreateBitCast(FunAddrArray, I64PtrTy);
+		auto GEP = Builder.CreateGEP(I64Ty, BitCast, FunID);
+		ExpectedTarget = Builder.CreateLoad(I64Ty, GEP);
+	}
 	auto Target = Builder.CreateLoad(I64Ty, TargetAddr);
 
 	auto CMP = Builder.CreateICmpEQ(ExpectedTarget, Target);
@@ -480,87 +833,968 @@ makeICallChecker(Module &M)
 	return Func;
 }
 
+// Whether some icall may skip its check, per -flta-sample-*
+static bool
+isSampling()
+{
+	return SampleRate > 1 || !SampleFuncRates.empty() || !SampleSiteRates.empty();
+}
+
+// The N of a `<key>=<N>` rate in Rates whose key is Key, 0 if none is
+static unsigned
+findSampleRate(const cl::list<std::string> &Rates, StringRef Key)
+{
+	for (auto &&Item : Rates)
+	{
+		auto KV = StringRef(Item).split('=');
+		unsigned Rate = 0;
+		if (KV.second.getAsInteger(10, Rate))
+			errs() << "FLTA: bad sample rate " << Item << "\n";
+		else if (KV.first == Key)
+			return Rate;
+	}
+	return 0;
+}
+
+// How often icall ICallID runs its full check: the rate of the site, else
+// of its function, else the global one
+static unsigned
+getSampleRate(CallBase *ICall, uint64_t ICallID)
+{
+	auto Rate = findSampleRate(SampleSiteRates, std::to_string(ICallSiteIDs[ICallID]));
+	if (0 == Rate)
+		Rate = findSampleRate(SampleFuncRates, ICall->getFunction()->getName());
+	if (0 == Rate)
+		Rate = SampleRate;
+	return std::max(Rate, 1u);
+}
+
+// For each icall whose callee is loop-invariant, an empty block on the
+// entry edge of the outermost loop it is invariant in, to check it once
+// there. A callee loaded in the loop is not invariant: memory may change.
+// The site still branches on the hoisted result, so a loop that runs zero
+// times never reports.
+static DenseMap<CallBase *, BasicBlock *>
+getICallHoistBlocks()
+{
+	DenseMap<CallBase *, BasicBlock *> Preheaders;
+	DenseMap<Function *, std::vector<CallBase *>> Func2ICalls;
+	// LICM hoists membership tests itself. Prefix checks load from the
+	// callee, which may be a null or stale pointer the loop never calls.
+	if (!UseHoist || UseLateLower || CheckMode == CHECK_PREFIX)
+		return Preheaders;
+	for (auto &&ICall : ICalls)
+		Func2ICalls[ICall->getFunction()].push_back(ICall);
+	for (auto &&Item : Func2ICalls)
+	{
+		DominatorTree DT(*Item.first);
+		LoopInfo LI(DT);
+		for (auto &&ICall : Item.second)
+		{
+			auto Callee = ICall->getCalledOperand();
+			for (auto L = LI.getLoopFor(ICall->getParent());
+				 nullptr != L && L->isLoopInvariant(Callee) && nullptr != L->getLoopPreheader();
+				 L = L->getParentLoop())
+				Preheaders[ICall] = L->getLoopPreheader();
+		}
+	}
+
+	// Split only now, the loops are computed on the original CFG
+	DenseMap<CallBase *, BasicBlock *> HoistBlocks;
+	for (auto &&ICall : ICalls)
+		if (Preheaders.count(ICall))
+			HoistBlocks[ICall] = SplitBlock(Preheaders[ICall], Preheaders[ICall]->getTerminator());
+	return HoistBlocks;
+}
+
+// The one violation handler all checks call, void (i64 site, i64 target):
+// cold and noreturn, so the failing paths stay out of the hot code.
+// `dprintf(2, "CFI violation detected!!! ..."); abort();`
+// With -flta-log-only, the cfi_rt counter, which returns.
+static Function *
+getViolationHandler(Module &M)
+{
+	if (LogOnly)
+		return getLogReport(M);
+	if (UseRuntime)
+		return getRuntimeReport(M);
+	auto Func = M.getFunction(VIOLATION_HANDLER);
+	if (nullptr != Func)
+		return Func;
+
+	Func = Function::Create(
+		FunctionType::get(VoidTy, {I64Ty, I64Ty}, false),
+		Function::InternalLinkage, VIOLATION_HANDLER, M);
+	Func->setDoesNotReturn();
+	Func->setDoesNotThrow();
+	Func->addFnAttr(Attribute::Cold);
+	Func->addFnAttr(Attribute::NoInline);
+	auto Site = Func->getArg(0);
+	Site->setName("site");
+	auto Target = Func->getArg(1);
+	Target->setName("target");
+
+	FunctionType *AbortTy = FunctionType::get(VoidTy, false);
+	auto Abort = M.getOrInsertFunction("abort", AbortTy);
+	FunctionType *DprintfTy = FunctionType::get(I32Ty, {I32Ty, I8PtrTy}, true);
+	auto Dprintf = M.getOrInsertFunction("dprintf", DprintfTy);
+
+	IRBuilder<> Builder(BasicBlock::Create(M.getContext(), "entry", Func));
+	// stderr => 2
+	auto FormatStr = Builder.CreateGlobalStringPtr("CFI violation detected!!! site %ld, target %p\n");
+	Builder.CreateCall(Dprintf, {ConstantInt::get(I32Ty, 2), FormatStr, Site, Target});
+	Builder.CreateCall(Abort);
+	Builder.CreateUnreachable();
+	return Func;
+}
+
+// Report that the call of icall SiteID went to Callee.
 static void
-makeICallCheckerInstrument(Module &M)
+makeViolationReport(Module &M, IRBuilder<> &Builder, int64_t SiteID, Value *Callee)
+{
+	Builder.CreateCall(
+		getViolationHandler(M),
+		{ConstantInt::get(I64Ty, SiteID), Builder.CreatePtrToInt(Callee, I64Ty)});
+}
+
+// A block reporting the violation, for the checks of ICall to branch to.
+// Logged violations go on to the call in PassBB.
+static BasicBlock *
+makeViolationBlock(Module &M, CallBase *ICall, int64_t SiteID, BasicBlock *PassBB)
+{
+	auto *FailBB = BasicBlock::Create(M.getContext(), "cfi.fail", ICall->getFunction());
+	IRBuilder<> Builder(FailBB);
+	makeViolationReport(M, Builder, SiteID, ICall->getCalledOperand());
+	if (LogOnly)
+		Builder.CreateBr(PassBB);
+	else
+		Builder.CreateUnreachable();
+	return FailBB;
+}
+
+// Mark the conditional branches to FailBB as unlikely to take it.
+static void
+setUnlikely(BasicBlock *FailBB)
+{
+	MDBuilder MDB(FailBB->getContext());
+	for (auto &&Pred : predecessors(FailBB))
+	{
+		auto Br = dyn_cast<BranchInst>(Pred->getTerminator());
+		if (nullptr == Br || !Br->isConditional())
+			continue;
+		Br->setMetadata(
+			LLVMContext::MD_prof,
+			Br->getSuccessor(0) == FailBB ? MDB.createBranchWeights(1, PASS_WEIGHT)
+										  : MDB.createBranchWeights(PASS_WEIGHT, 1));
+	}
+}
+
+// One checker call per target, and them all ANDed: 0 if Callee is one of
+// Targets.
+static Value *
+makeLinearCheck(Module &M, IRBuilder<> &Builder, Value *Callee, const std::vector<uint64_t> &Targets)
 {
 	auto Func = makeICallChecker(M);
-	uint64_t Counter = 0;
 	std::vector<Value *> ICallCheckerArgs;
 	llvm::SmallVector<Value *> RetVals;
+	RetVals.push_back(ConstantInt::get(I32Ty, -1));
+	for (auto &&TargetID : Targets)
+	{
+		ICallCheckerArgs.clear();	
+		auto FuncAddr = Builder.CreatePtrToInt(Callee, I64Ty);
+		// Not in the relative table, compare with the address itself
+		if (UseRelTables && !isRelEncodable(AddrTakenFuncs[TargetID]))
+		{
+			auto Expected = ConstantExpr::getPtrToInt(AddrTakenFuncs[TargetID], I64Ty);
+			RetVals.push_back(Builder.CreateSelect(
+				Builder.CreateICmpEQ(FuncAddr, Expected),
+				ConstantInt::get(I32Ty, 0),
+				ConstantInt::get(I32Ty, -1)));
+			continue;
+		}
+		ICallCheckerArgs.push_back(ConstantInt::get(I64Ty, TargetID));
+		ICallCheckerArgs.push_back(FuncAddr);
+		auto RetVal = Builder.CreateCall(Func, ICallCheckerArgs);
+		RetVals.push_back(RetVal);
+	}
+	return Builder.CreateAnd(RetVals);
+}
 
-	/* create void abort(void) declarations */
-	std::vector<Type *> AbortProtoTypeArgs;
-	AbortProtoTypeArgs.push_back(VoidTy);
-	FunctionType *AbortTy = FunctionType::get(VoidTy, true);
-	M.getOrInsertFunction("abort", AbortTy);
-	Function *Abort = M.getFunction("abort");
-	std::vector<Value *> AbortArgs;
-
-	/* create i32 dprintf(i32, i8*, ...) declarations */
-	std::vector<Type *> DprintfProtoTypeArgs;
-	DprintfProtoTypeArgs.push_back(I32Ty);
-	DprintfProtoTypeArgs.push_back(I8PtrTy);
-	FunctionType *PrintfTy = FunctionType::get(I32Ty, true);
-	M.getOrInsertFunction("dprintf", PrintfTy);
-	Function *Dprintf = M.getFunction("dprintf");
-	std::vector<Value *> DprintfArgs;
+static Value *
+makeCheckValue(Module &M, BasicBlock *BB, Value *Callee, uint64_t ICallID,
+			   const std::vector<uint64_t> &Targets);
 
+static void
+makeICallCheckerInstrument(Module &M)
+{
+	if (isSampling())
+		makeSampleCounters(M, NumICallSites);
+	auto HoistBlocks = getICallHoistBlocks();
+	uint64_t Counter = 0;
+	MDBuilder MDB(M.getContext());
 	for (auto &&ICall : ICalls)
 	{
 		// get target's IDs
 		auto Iter = ICallID2FuncID.find(Counter);
 		assert(Iter != ICallID2FuncID.end() && "Can not find target!!!!");
 		auto Targets = (*Iter).second;
-		IRBuilder<> Builder(ICall);
-		AbortArgs.clear();
-		RetVals.clear();
-		RetVals.push_back(ConstantInt::get(I32Ty, -1));
-		for (auto &&TargetID : Targets)
+		if (LogCalls)
 		{
-			ICallCheckerArgs.clear();	
-			auto FuncAddr = Builder.CreatePtrToInt(ICall->getCalledOperand(), I64Ty);
-			ICallCheckerArgs.push_back(ConstantInt::get(I64Ty, TargetID));
-			ICallCheckerArgs.push_back(FuncAddr);
-			auto RetVal = Builder.CreateCall(Func, ICallCheckerArgs);
-			RetVals.push_back(RetVal);
+			IRBuilder<> Builder(ICall);
+			makeLogCount(M, Builder, ICallSiteIDs[Counter]);
 		}
+		auto Hoist = HoistBlocks.find(ICall);
+		Instruction *CheckPt = ICall;
+		Value *CMP = nullptr;
+		// Hoisted checks are already cheap, they are not sampled
+		auto Rate = getSampleRate(ICall, Counter);
+		if (Hoist != HoistBlocks.end())
+		{
+			// Checked before the loop, reported at the call: a loop that
+			// never makes it does not report
+			auto OK = makeCheckValue(M, Hoist->second, ICall->getCalledOperand(), Counter, Targets);
+			CMP = IRBuilder<>(ICall).CreateNot(OK);
+		}
+		else
+		{
+			if (Rate > 1)
+			{
+				IRBuilder<> Builder(ICall);
+				CheckPt = SplitBlockAndInsertIfThen(
+					makeSampleGate(Builder, ICallSiteIDs[Counter], Rate), ICall, false,
+					MDB.createBranchWeights(1, Rate - 1));
+			}
+			// The hot targets skip the call to the checker
+			auto Hot = ICallID2HotFuncID.find(Counter);
+			if (Hot != ICallID2HotFuncID.end())
+			{
+				IRBuilder<> Builder(CheckPt);
+				auto Addr = Builder.CreatePtrToInt(ICall->getCalledOperand(), I64Ty);
+				Value *IsHot = Builder.getFalse();
+				for (auto &&TargetID : Hot->second)
+					IsHot = Builder.CreateOr(
+						IsHot,
+						Builder.CreateICmpEQ(Addr, ConstantExpr::getPtrToInt(AddrTakenFuncs[TargetID], I64Ty)));
+				CheckPt = SplitBlockAndInsertIfThen(
+					Builder.CreateNot(IsHot), CheckPt, false,
+					MDB.createBranchWeights(100 - HotCoverage + 1, HotCoverage));
+			}
+			IRBuilder<> Builder(CheckPt);
+			auto Res = makeLinearCheck(M, Builder, ICall->getCalledOperand(), Targets);
+			CMP = Builder.CreateICmpNE(Res, ConstantInt::get(I32Ty, 0));
+		}
+		auto Term = SplitBlockAndInsertIfThen(CMP, CheckPt, !LogOnly, MDB.createBranchWeights(1, PASS_WEIGHT));
 		
-		auto Res = Builder.CreateAnd(RetVals);
-		auto CMP = Builder.CreateICmpNE(Res, ConstantInt::get(I32Ty, 0));
-		auto Term = SplitBlockAndInsertIfThen(CMP, ICall, false);
-		
-		Builder.SetInsertPoint(Term);
+		IRBuilder<> Builder(Term);
 		// BOOM
-		// stderr => 2
-		DprintfArgs.push_back(ConstantInt::get(I32Ty, 2));
-		auto FormatStr = Builder.CreateGlobalStringPtr("CFI violation detected!!!\n");
-		DprintfArgs.push_back(FormatStr);
-		Builder.CreateCall(Dprintf, DprintfArgs);
-	 	Builder.CreateCall(Abort, AbortArgs);	
+		makeViolationReport(M, Builder, ICallSiteIDs[Counter], ICall->getCalledOperand());
 		Counter++; 
 	}
-	
+}
+
+// Compare Callee with each target in turn and branch to PassBB on the first
+// match: no call, the callee address is computed once.
+static void
+makeInlineCheck(Module &M, IRBuilder<> &Builder, Value *Callee,
+				const std::vector<uint64_t> &Targets, BasicBlock *PassBB, BasicBlock *FailBB)
+{
+	auto Func = Builder.GetInsertBlock()->getParent();
+	auto Addr = Builder.CreatePtrToInt(Callee, I64Ty);
+	for (auto &&TargetID : Targets)
+	{
+		auto CMP = Builder.CreateICmpEQ(
+			Addr,
+			ConstantExpr::getPtrToInt(getJumpTableEntry(AddrTakenFuncs[TargetID]), I64Ty));
+		// The last compare fails straight to FailBB
+		if (TargetID == Targets.back())
+		{
+			Builder.CreateCondBr(CMP, PassBB, FailBB);
+			return;
+		}
+		auto NextBB = BasicBlock::Create(M.getContext(), "cfi.check", Func, FailBB);
+		Builder.CreateCondBr(CMP, PassBB, NextBB);
+		Builder.SetInsertPoint(NextBB);
+	}
+	Builder.CreateBr(FailBB);
+}
+
+// Check the targets Covered accepts with the single check MakeCheck builds
+// for them, and the others with inline compares.
+static void
+makeTableGuard(Module &M, IRBuilder<> &Builder, Value *Callee,
+			   const std::vector<uint64_t> &Targets, BasicBlock *PassBB, BasicBlock *FailBB,
+			   function_ref<bool(Function *)> Covered,
+			   function_ref<Value *(Value *, const std::vector<Function *> &)> MakeCheck)
+{
+	std::vector<Function *> InTable;
+	std::vector<uint64_t> Others;
+	for (auto &&TargetID : Targets)
+	{
+		if (Covered(AddrTakenFuncs[TargetID]))
+			InTable.push_back(AddrTakenFuncs[TargetID]);
+		else
+			Others.push_back(TargetID);
+	}
+
+	if (!InTable.empty())
+	{
+		auto Addr = Builder.CreatePtrToInt(Callee, I64Ty);
+		auto OK = MakeCheck(Addr, InTable);
+		if (Others.empty())
+		{
+			Builder.CreateCondBr(OK, PassBB, FailBB);
+			return;
+		}
+		auto NextBB = BasicBlock::Create(M.getContext(), "cfi.check", PassBB->getParent(), FailBB);
+		Builder.CreateCondBr(OK, PassBB, NextBB);
+		Builder.SetInsertPoint(NextBB);
+	}
+	makeInlineCheck(M, Builder, Callee, Others, PassBB, FailBB);
+}
+
+// Check Callee with a bitset over the jump table, and the targets that are
+// not in the table (declarations) with inline compares.
+static void
+makeJumpTableGuard(Module &M, IRBuilder<> &Builder, Value *Callee,
+				   const std::vector<uint64_t> &Targets, BasicBlock *PassBB, BasicBlock *FailBB)
+{
+	makeTableGuard(M, Builder, Callee, Targets, PassBB, FailBB, isJumpTableCandidate,
+				   [&](Value *Addr, const std::vector<Function *> &Funcs)
+				   { return makeJumpTableCheck(M, Builder, Addr, Funcs); });
+}
+
+// Address-taken functions grouped by type (types FLTA takes as identical
+// share a class), the classes are disjoint.
+static std::vector<std::vector<Function *>>
+getTypeClasses()
+{
+	std::vector<std::vector<Function *>> Classes;
+	for (auto &&Func : AddrTakenFuncs)
+	{
+		auto It = find_if(Classes, [&](const std::vector<Function *> &Class)
+						  { return isIdenticalType(Class.front()->getFunctionType(), Func->getFunctionType()); });
+		if (It == Classes.end())
+			Classes.push_back({Func});
+		else
+			It->push_back(Func);
+	}
+	return Classes;
+}
+
+// Check Callee with MakeCheck for the classes (from GetClass) the site may
+// call every function of. Targets of classes it only partly covers
+// (narrowed sets), and the ones in no class, are compared inline.
+static void
+makeClassGuard(Module &M, IRBuilder<> &Builder, Value *Callee,
+			   const std::vector<uint64_t> &Targets, BasicBlock *PassBB, BasicBlock *FailBB,
+			   function_ref<int(const Function *)> GetClass,
+			   function_ref<Value *(Value *, const std::vector<unsigned> &)> MakeCheck)
+{
+	DenseMap<int, unsigned> Hits;
+	for (auto &&TargetID : Targets)
+		Hits[GetClass(AddrTakenFuncs[TargetID])]++;
+
+	auto Covered = [&](Function *Func)
+	{
+		auto Class = GetClass(Func);
+		return Class >= 0 && Hits[Class] == ClassSizes[Class];
+	};
+	makeTableGuard(M, Builder, Callee, Targets, PassBB, FailBB, Covered,
+				   [&](Value *Addr, const std::vector<Function *> &Funcs)
+				   {
+					   std::vector<unsigned> Classes;
+					   for (auto &&Func : Funcs)
+						   if (!is_contained(Classes, (unsigned)GetClass(Func)))
+							   Classes.push_back(GetClass(Func));
+					   return MakeCheck(Addr, Classes);
+				   });
+}
+
+// Size of each class, counting only the functions GetClass placed in one
+static void
+countClassSizes(unsigned NumClasses, function_ref<int(const Function *)> GetClass)
+{
+	ClassSizes.assign(NumClasses, 0);
+	for (auto &&Func : AddrTakenFuncs)
+		if (GetClass(Func) >= 0)
+			ClassSizes[GetClass(Func)]++;
+}
+
+// Address-taken functions ordered so that the targets of each icall are
+// close together: sets are visited from the smallest one, each appending
+// its members not placed yet.
+static std::vector<Function *>
+getClusteredFuncOrder()
+{
+	std::vector<const std::vector<uint64_t> *> Sets;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+		Sets.push_back(&ICallID2FuncID[ICallID]);
+	std::stable_sort(Sets.begin(), Sets.end(),
+					 [](const std::vector<uint64_t> *Left, const std::vector<uint64_t> *Right)
+					 { return Left->size() < Right->size(); });
+
+	std::vector<bool> Placed(AddrTakenFuncs.size(), false);
+	std::vector<Function *> Order;
+	for (auto &&Set : Sets)
+		for (auto &&FuncID : *Set)
+		{
+			if (Placed[FuncID])
+				continue;
+			Placed[FuncID] = true;
+			Order.push_back(AddrTakenFuncs[FuncID]);
+		}
+	for (uint64_t FuncID = 0; FuncID < AddrTakenFuncs.size(); FuncID++)
+		if (!Placed[FuncID])
+			Order.push_back(AddrTakenFuncs[FuncID]);
+	return Order;
+}
+
+// Distinct target sets of Threshold to Max functions, each shared by the
+// icalls with that set (ICallID2SetID).
+static std::vector<std::vector<Function *>>
+getLargeTargetSets(unsigned Threshold, unsigned Max = UINT_MAX)
+{
+	std::map<std::vector<uint64_t>, unsigned> SetIDs;
+	std::vector<std::vector<Function *>> Sets;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+	{
+		auto Targets = ICallID2FuncID[ICallID];
+		if (Targets.empty() || Targets.size() < Threshold || Targets.size() > Max)
+			continue;
+		std::sort(Targets.begin(), Targets.end());
+		auto It = SetIDs.find(Targets);
+		if (It == SetIDs.end())
+		{
+			It = SetIDs.insert(std::make_pair(Targets, Sets.size())).first;
+			Sets.emplace_back();
+			for (auto &&TargetID : Targets)
+				Sets.back().push_back(AddrTakenFuncs[TargetID]);
+		}
+		ICallID2SetID[ICallID] = It->second;
+	}
+	return Sets;
+}
+
+// Check Callee against the Targets of icall ICallID with the -flta-check
+// mode, branching to PassBB or FailBB.
+static void
+makeModeCheck(Module &M, IRBuilder<> &Builder, Value *Callee, uint64_t ICallID,
+			  const std::vector<uint64_t> &Targets, BasicBlock *PassBB, BasicBlock *FailBB)
+{
+	switch (CheckMode)
+	{
+	case CHECK_LINEAR:
+		Builder.CreateCondBr(
+			Builder.CreateICmpEQ(makeLinearCheck(M, Builder, Callee, Targets), ConstantInt::get(I32Ty, 0)),
+			PassBB, FailBB);
+		break;
+	case CHECK_INLINE:
+		makeInlineCheck(M, Builder, Callee, Targets, PassBB, FailBB);
+		break;
+	case CHECK_JUMPTABLE:
+		makeJumpTableGuard(M, Builder, Callee, Targets, PassBB, FailBB);
+		break;
+	case CHECK_CLUSTER:
+		makeClassGuard(M, Builder, Callee, Targets, PassBB, FailBB, getCluster,
+					   [&](Value *Addr, const std::vector<unsigned> &Clusters)
+					   { return makeClusterCheck(Builder, Addr, Clusters); });
+		break;
+	case CHECK_BSEARCH:
+	case CHECK_MPH:
+	case CHECK_SIMD:
+	case CHECK_RUNTIME:
+		if (ICallID2SetID.count(ICallID))
+		{
+			auto Addr = Builder.CreatePtrToInt(Callee, I64Ty);
+			Value *OK = nullptr;
+			if (CheckMode == CHECK_BSEARCH)
+				OK = makeSortedSetCheck(M, Builder, Addr, ICallID2SetID[ICallID]);
+			else if (CheckMode == CHECK_MPH)
+				OK = makePerfectHashCheck(M, Builder, Addr, ICallID2SetID[ICallID]);
+			else if (CheckMode == CHECK_SIMD)
+				OK = makeSIMDSetCheck(M, Builder, Addr, ICallID2SetID[ICallID]);
+			else
+				OK = makeRuntimeCheck(M, Builder, Addr, ICallID2SetID[ICallID]);
+			Builder.CreateCondBr(OK, PassBB, FailBB);
+		}
+		else
+			makeInlineCheck(M, Builder, Callee, Targets, PassBB, FailBB);
+		break;
+	case CHECK_PREFIX:
+		makeClassGuard(M, Builder, Callee, Targets, PassBB, FailBB, getPrefixTag,
+					   [&](Value *Addr, const std::vector<unsigned> &Classes)
+					   { return makePrefixTagCheck(Builder, Addr, Classes); });
+		break;
+	default:
+		llvm_unreachable("CheckMode is invalid!");
+		break;
+	}
+}
+
+// Run the check of Callee at the end of BB (in a hoist block, or where a
+// membership test is lowered), hot targets first; the result is an i1 to
+// branch on.
+static Value *
+makeCheckValue(Module &M, BasicBlock *BB, Value *Callee, uint64_t ICallID,
+			   const std::vector<uint64_t> &Targets)
+{
+	auto ContBB = SplitBlock(BB, BB->getTerminator());
+	BB->getTerminator()->eraseFromParent();
+	auto BadBB = BasicBlock::Create(M.getContext(), "cfi.bad", BB->getParent(), ContBB);
+	BranchInst::Create(ContBB, BadBB);
+
+	IRBuilder<> Builder(BB);
+	auto Hot = ICallID2HotFuncID.find(ICallID);
+	if (Hot != ICallID2HotFuncID.end() && CheckMode != CHECK_INLINE)
+	{
+		auto SlowBB = BasicBlock::Create(M.getContext(), "cfi.slow", BB->getParent(), BadBB);
+		makeInlineCheck(M, Builder, Callee, Hot->second, ContBB, SlowBB);
+		Builder.SetInsertPoint(SlowBB);
+	}
+	makeModeCheck(M, Builder, Callee, ICallID, Targets, ContBB, BadBB);
+	setUnlikely(BadBB);
+	auto OK = PHINode::Create(I1Ty, 2, "cfi.ok", &ContBB->front());
+	for (auto &&Pred : predecessors(ContBB))
+		OK->addIncoming(ConstantInt::getBool(M.getContext(), Pred != BadBB), Pred);
+	return OK;
+}
+
+// A pure stand-in for the check of icall ICallID: the optimizer can merge,
+// hoist and drop membership tests like any readnone call, until
+// makeMembershipLowering expands them. Icalls with the same target set
+// share an ID, so their tests on the same callee are merged too.
+static Function *
+getMembership(Module &M)
+{
+	auto Func = M.getFunction(MEMBERSHIP);
+	if (nullptr != Func)
+		return Func;
+	Func = Function::Create(
+		FunctionType::get(I1Ty, {I64Ty, I8PtrTy}, false),
+		Function::ExternalLinkage, MEMBERSHIP, M);
+	Func->setDoesNotAccessMemory();
+	Func->setDoesNotThrow();
+	Func->addFnAttr(Attribute::WillReturn);
+	// Prefix checks load from the callee, they must not run where the
+	// call would not
+	if (CheckMode != CHECK_PREFIX)
+		Func->addFnAttr(Attribute::Speculatable);
+	return Func;
+}
+
+// Expand every membership test into the -flta-check mode. Needs the state
+// of the flta pass: run in the same opt, e.g. -passes='flta,default<O2>,flta-lower'
+static void
+makeMembershipLowering(Module &M)
+{
+	auto Membership = M.getFunction(MEMBERSHIP);
+	if (nullptr == Membership)
+		return;
+	std::vector<CallInst *> Tests;
+	for (auto &&U : Membership->users())
+		Tests.push_back(cast<CallInst>(U));
+	for (auto &&Test : Tests)
+	{
+		auto ICallID = cast<ConstantInt>(Test->getArgOperand(0))->getZExtValue();
+		auto Iter = ICallID2FuncID.find(ICallID);
+		if (Iter == ICallID2FuncID.end())
+			report_fatal_error("FLTA: flta-lower has to run after flta in the same opt");
+		auto &Targets = (*Iter).second;
+
+		// Devirtualized (or inlined) down to a known function
+		Value *OK = nullptr;
+		auto Callee = Test->getArgOperand(1);
+		if (auto Func = dyn_cast<Function>(Callee->stripPointerCasts()))
+			OK = ConstantInt::getBool(
+				M.getContext(),
+				is_contained(AddrTakenFuncs, Func) && is_contained(Targets, getFuncID(Func)));
+		else
+		{
+			auto BB = Test->getParent();
+			SplitBlock(BB, Test);
+			OK = makeCheckValue(M, BB, Callee, ICallID, Targets);
+		}
+		Test->replaceAllUsesWith(OK);
+		Test->eraseFromParent();
+	}
+	Membership->eraseFromParent();
+}
+
+// Guard every icall with a check branching straight to the call when it
+// passes, and to a violation block otherwise.
+static void
+makeICallGuardInstrument(Module &M)
+{
+	if (CheckMode == CHECK_JUMPTABLE)
+	{
+		std::vector<Function *> Funcs;
+		for (auto &&Func : getClusteredFuncOrder())
+			if (isJumpTableCandidate(Func))
+				Funcs.push_back(Func);
+		makeJumpTable(M, Funcs);
+	}
+	else if (CheckMode == CHECK_CLUSTER)
+	{
+		auto Classes = getTypeClasses();
+		makeClusters(M, Classes, ClusterAlign);
+		countClassSizes(Classes.size(), getCluster);
+	}
+	else if (CheckMode == CHECK_BSEARCH)
+	{
+		makeSortedSets(M, getLargeTargetSets(BSearchThreshold));
+	}
+	else if (CheckMode == CHECK_SIMD)
+	{
+		makeSIMDSets(M, getLargeTargetSets(SIMDMin, SIMDMax));
+	}
+	else if (CheckMode == CHECK_RUNTIME)
+	{
+		makeRuntimeSets(M, getLargeTargetSets(1));
+	}
+	else if (CheckMode == CHECK_MPH)
+	{
+		makePerfectHashes(M, getLargeTargetSets(MPHThreshold));
+	}
+	else if (CheckMode == CHECK_PREFIX)
+	{
+		auto Classes = getTypeClasses();
+		makePrefixTags(M, Classes);
+		countClassSizes(Classes.size(), getPrefixTag);
+	}
+
+	if (UseICache)
+	{
+		std::vector<std::vector<Function *>> SiteTargets;
+		for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+		{
+			SiteTargets.emplace_back();
+			for (auto &&TargetID : ICallID2FuncID[ICallID])
+				SiteTargets.back().push_back(AddrTakenFuncs[TargetID]);
+		}
+		makeICache(M, SiteTargets, ICacheStats);
+	}
+	if (isSampling())
+		makeSampleCounters(M, NumICallSites);
+
+	auto HoistBlocks = getICallHoistBlocks();
+	std::map<std::vector<uint64_t>, uint64_t> SetLeaders;
+	std::vector<BasicBlock *> FailBBs;
+	uint64_t Counter = 0;
+	for (auto &&ICall : ICalls)
+	{
+		auto ICallID = Counter;
+		auto Iter = ICallID2FuncID.find(Counter++);
+		assert(Iter != ICallID2FuncID.end() && "Can not find target!!!!");
+		auto &Targets = (*Iter).second;
+
+		auto HeadBB = ICall->getParent();
+		auto PassBB = SplitBlock(HeadBB, ICall);
+		HeadBB->getTerminator()->eraseFromParent();
+		auto FailBB = makeViolationBlock(M, ICall, ICallSiteIDs[ICallID], PassBB);
+		FailBBs.push_back(FailBB);
+
+		IRBuilder<> Builder(HeadBB);
+		if (LogCalls)
+			makeLogCount(M, Builder, ICallSiteIDs[ICallID]);
+		// Checked once before the loop, no sampling, cache or fast path to
+		// beat that
+		auto Hoist = HoistBlocks.find(ICall);
+		if (Hoist != HoistBlocks.end())
+		{
+			Builder.CreateCondBr(
+				makeCheckValue(M, Hoist->second, ICall->getCalledOperand(), ICallID, Targets),
+				PassBB, FailBB);
+			continue;
+		}
+		auto Rate = getSampleRate(ICall, ICallID);
+		if (Rate > 1)
+		{
+			auto SampledBB = BasicBlock::Create(M.getContext(), "cfi.sampled", HeadBB->getParent(), FailBB);
+			auto Br = Builder.CreateCondBr(makeSampleGate(Builder, ICallSiteIDs[ICallID], Rate), SampledBB, PassBB);
+			Br->setMetadata(LLVMContext::MD_prof, MDBuilder(M.getContext()).createBranchWeights(1, Rate - 1));
+			Builder.SetInsertPoint(SampledBB);
+		}
+		if (UseLateLower)
+		{
+			auto Set = Targets;
+			llvm::sort(Set);
+			auto LeaderID = SetLeaders.emplace(Set, ICallID).first->second;
+			auto Callee = Builder.CreateBitCast(ICall->getCalledOperand(), I8PtrTy);
+			Builder.CreateCondBr(
+				Builder.CreateCall(getMembership(M), {ConstantInt::get(I64Ty, LeaderID), Callee}),
+				PassBB, FailBB);
+			continue;
+		}
+		// The full check refreshes the cache slot on its way to the call
+		auto CheckedBB = PassBB;
+		if (UseICache)
+		{
+			auto Addr = Builder.CreatePtrToInt(ICall->getCalledOperand(), I64Ty);
+			auto MissBB = BasicBlock::Create(M.getContext(), "cfi.miss", HeadBB->getParent(), FailBB);
+			CheckedBB = BasicBlock::Create(M.getContext(), "cfi.refresh", HeadBB->getParent(), FailBB);
+			Builder.CreateCondBr(makeICacheLookup(Builder, Addr, ICallID), PassBB, MissBB);
+			Builder.SetInsertPoint(CheckedBB);
+			makeICacheRefresh(Builder, Addr, ICallID);
+			Builder.CreateBr(PassBB);
+			Builder.SetInsertPoint(MissBB);
+		}
+		// Inline compares already come in profile order
+		auto Hot = ICallID2HotFuncID.find(ICallID);
+		if (Hot != ICallID2HotFuncID.end() && CheckMode != CHECK_INLINE)
+		{
+			auto SlowBB = BasicBlock::Create(M.getContext(), "cfi.slow", HeadBB->getParent(), FailBB);
+			makeInlineCheck(M, Builder, ICall->getCalledOperand(), Hot->second, PassBB, SlowBB);
+			Builder.SetInsertPoint(SlowBB);
+		}
+		makeModeCheck(M, Builder, ICall->getCalledOperand(), ICallID, Targets, CheckedBB, FailBB);
+	}
+	for (auto &&FailBB : FailBBs)
+		setUnlikely(FailBB);
+}
+
+// Remove the icalls Dropped from ICalls and renumber the others; their
+// site IDs stay
+static void
+dropICalls(const DenseSet<uint64_t> &Dropped)
+{
+	std::vector<CallBase *> Kept;
+	std::vector<FunctionType *> KeptTypes;
+	std::vector<uint64_t> KeptSiteIDs;
+	llvm::DenseMap<uint64_t, std::vector<uint64_t>> KeptTargets;
+	llvm::DenseMap<uint64_t, std::vector<uint64_t>> KeptHot;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+	{
+		if (Dropped.count(ICallID))
+			continue;
+		KeptTargets[Kept.size()] = ICallID2FuncID[ICallID];
+		if (ICallID2HotFuncID.count(ICallID))
+			KeptHot[Kept.size()] = ICallID2HotFuncID[ICallID];
+		Kept.push_back(ICalls[ICallID]);
+		KeptTypes.push_back(ICallTypes[ICallID]);
+		KeptSiteIDs.push_back(ICallSiteIDs[ICallID]);
+	}
+	ICalls = Kept;
+	ICallTypes = KeptTypes;
+	ICallSiteIDs = KeptSiteIDs;
+	ICallID2FuncID = KeptTargets;
+	ICallID2HotFuncID = KeptHot;
+}
+
+// Turn each icall with 1 to PromoteMax targets into
+//   if (fp == f1) f1(...); else if (fp == f2) f2(...); else violation
+// the compare is the check, and the direct calls can be inlined. Promoted
+// icalls are dropped from ICalls, the others are renumbered.
+static void
+makeICallPromotion(Module &M)
+{
+	DenseSet<uint64_t> Promoted;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+	{
+		auto ICall = ICalls[ICallID];
+		auto &Targets = ICallID2FuncID[ICallID];
+		bool Legal = !Targets.empty() && Targets.size() <= PromoteMax;
+		for (auto &&TargetID : Targets)
+			Legal = Legal && isLegalToPromote(*ICall, AddrTakenFuncs[TargetID]);
+		if (!Legal)
+			continue;
+
+		// Each promotion leaves ICall in the else branch
+		for (auto &&TargetID : Targets)
+			promoteCallWithIfThenElse(*ICall, AddrTakenFuncs[TargetID]);
+		IRBuilder<> Builder(ICall);
+		makeViolationReport(M, Builder, NO_SITE, ICall->getCalledOperand());
+		// Logged, the call is made anyway
+		if (!LogOnly)
+			changeToUnreachable(ICall);
+		Promoted.insert(ICallID);
+	}
+	LOG_STR("FLTA: promoted " << Promoted.size() << " icalls");
+	dropICalls(Promoted);
+}
+
+// Collect into Callees the functions Val can be, tracing back through
+// casts, phis, selects and loads from constant globals. False if it can
+// be anything else: an argument, a call, writable memory...
+static bool
+getStaticCallees(Value *Val, const DataLayout &DL, SmallPtrSetImpl<Function *> &Callees,
+				 SmallPtrSetImpl<Value *> &Visited)
+{
+	Val = Val->stripPointerCasts();
+	if (!Visited.insert(Val).second)
+		return true;
+	if (auto Func = dyn_cast<Function>(Val))
+	{
+		Callees.insert(Func);
+		return true;
+	}
+	if (auto PN = dyn_cast<PHINode>(Val))
+		return all_of(PN->incoming_values(), [&](Value *In)
+					  { return getStaticCallees(In, DL, Callees, Visited); });
+	if (auto SI = dyn_cast<SelectInst>(Val))
+		return getStaticCallees(SI->getTrueValue(), DL, Callees, Visited) &&
+			   getStaticCallees(SI->getFalseValue(), DL, Callees, Visited);
+	// Only constant indices: a variable one may go out of the table
+	if (auto LI = dyn_cast<LoadInst>(Val))
+	{
+		auto Ptr = dyn_cast<Constant>(LI->getPointerOperand());
+		if (LI->isVolatile() || nullptr == Ptr)
+			return false;
+		auto GV = dyn_cast<GlobalVariable>(getUnderlyingObject(Ptr));
+		if (nullptr == GV || !GV->isConstant() || !GV->hasDefinitiveInitializer())
+			return false;
+		auto Loaded = ConstantFoldLoadFromConstPtr(Ptr, LI->getType(), DL);
+		return nullptr != Loaded && getStaticCallees(Loaded, DL, Callees, Visited);
+	}
+	return false;
+}
+
+// Find the icalls whose callees are all allowed targets, known from the
+// IR alone: they need no check.
+static void
+makeStaticProof(Module &M)
+{
+	DenseSet<uint64_t> Proven;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+	{
+		auto ICall = ICalls[ICallID];
+		SmallPtrSet<Function *, 8> Callees;
+		SmallPtrSet<Value *, 8> Visited;
+		if (!getStaticCallees(ICall->getCalledOperand(), M.getDataLayout(), Callees, Visited))
+			continue;
+		auto &Targets = ICallID2FuncID[ICallID];
+		if (!all_of(Callees, [&](Function *Func)
+					{ return is_contained(AddrTakenFuncs, Func) && is_contained(Targets, getFuncID(Func)); }))
+			continue;
+		Proven.insert(ICallID);
+		if (PrintStats)
+		{
+			errs() << "FLTA: proven icall in " << ICall->getFunction()->getName();
+			if (auto &Loc = ICall->getDebugLoc())
+				errs() << " at " << Loc->getFilename() << ":" << Loc.getLine();
+			errs() << "\n";
+		}
+	}
+	if (PrintStats)
+		errs() << "FLTA: proven " << Proven.size() << " of " << ICalls.size() << " icalls safe at compile time\n";
+	dropICalls(Proven);
+}
+
+// Find the icalls whose check is redundant: a dominating icall through the
+// same pointer has already checked it against a subset of their targets.
+// The checks run before the calls, so passing the call of the dominating
+// one means the pointer is in its set. They stay calls, just unchecked.
+static void
+makeRedundantCheckElimination()
+{
+	DenseMap<Function *, std::vector<uint64_t>> Func2ICallIDs;
+	for (uint64_t ICallID = 0; ICallID < ICalls.size(); ICallID++)
+		Func2ICallIDs[ICalls[ICallID]->getFunction()].push_back(ICallID);
+
+	DenseSet<uint64_t> Redundant;
+	for (auto &&Item : Func2ICallIDs)
+	{
+		if (Item.second.size() < 2)
+			continue;
+		DominatorTree DT(*Item.first);
+		for (auto &&ICallID : Item.second)
+		{
+			auto ICall = ICalls[ICallID];
+			auto Targets = ICallID2FuncID[ICallID];
+			llvm::sort(Targets);
+			for (auto &&DomID : Item.second)
+			{
+				auto Dom = ICalls[DomID];
+				if (DomID == ICallID ||
+					Dom->getCalledOperand()->stripPointerCasts() != ICall->getCalledOperand()->stripPointerCasts() ||
+					!DT.dominates(Dom, ICall))
+					continue;
+				auto DomTargets = ICallID2FuncID[DomID];
+				llvm::sort(DomTargets);
+				if (std::includes(Targets.begin(), Targets.end(), DomTargets.begin(), DomTargets.end()))
+				{
+					Redundant.insert(ICallID);
+					break;
+				}
+			}
+		}
+	}
+	if (PrintStats)
+		errs() << "FLTA: removed " << Redundant.size() << " of " << ICalls.size() << " icall checks dominated by an equivalent one\n";
+	dropICalls(Redundant);
+}
+
+// Check the vtable pointer of every virtual call against the address
+// points of the classes derived from its static type.
+static void
+makeVCallCheckerInstrument(Module &M)
+{
+	for (auto &&VCall : getVCalls())
+	{
+		IRBuilder<> Builder(VCall.ICall);
+		auto OK = makeVTableCheck(Builder, VCall);
+		auto Term = SplitBlockAndInsertIfThen(
+			Builder.CreateNot(OK), VCall.ICall, !LogOnly,
+			MDBuilder(M.getContext()).createBranchWeights(1, PASS_WEIGHT));
+		Builder.SetInsertPoint(Term);
+		makeViolationReport(M, Builder, NO_SITE, VCall.ICall->getCalledOperand());
+	}
+	dropVCallTypeTests(M);
 }
 
 FLTA::Result
 FLTA::runOnModule(Module &M)
 {
+	if (UseVCall)
+	{
+		initVCalls(M);
+		layoutVTables(M);
+	}
+	if (UseCastFlow)
+		initCastFlow(M);
 	analysis(M);
+	if (UseDISig)
+		initDISignatures(M);
 	createType2FuncMapping();
 	CreateICallID2FuncIDMapping();
+	if (UseProfile)
+	{
+		initICallProfile(M);
+		orderICallTargetsByProfile();
+	}
 }
 
 PreservedAnalyses
 FLTA::run(llvm::Module &M, llvm::ModuleAnalysisManager &)
 {
+	if (CheckMode == CHECK_RUNTIME)
+		UseRuntime = true;
+	// flta-lower expands bare membership tests, the cache has no place there
+	if (UseICache && UseLateLower)
+		report_fatal_error("FLTA: -flta-icache can not be combined with -flta-late-lower");
 	runOnModule(M);
-	makeICallAddrArray(M);
+	if (PromoteMax)
+		makeICallPromotion(M);
+	if (UseStaticProof)
+		makeStaticProof(M);
+	// A dominating check may be skipped when sampling
+	if (UseDomElim && !isSampling())
+		makeRedundantCheckElimination();
 	makeFuncAddrArray(M);
+	// Sites are final, the counters can be laid out
+	if (LogOnly || LogCalls)
+		makeLogSegment(M, NumICallSites);
 	#if DEBUG
-	makeLoopPrinterInstrument(M, "main", FUNC_ADDRS);
-	makeLoopPrinterInstrument(M, "main", ICALL_ADDRS);
+	// Offsets are no addresses to print
+	if (!UseRelTables)
+		makeLoopPrinterInstrument(M, "main", FUNC_ADDRS);
 	#endif
-	makeICallCheckerInstrument(M);
+	if (CheckMode == CHECK_LINEAR && !UseLateLower)
+		makeICallCheckerInstrument(M);
+	else
+		makeICallGuardInstrument(M);
+	if (UseVCall)
+		makeVCallCheckerInstrument(M);
+	makeICallSites(M);
 	// printFuncs(llvm::errs(), AddrTakenFuncs);
 	// printIDMapResult(llvm::errs(), ICallID2FuncID);
 	// printCompare(llvm::errs(), (CallBase *)0x555556835b60);
@@ -571,6 +1805,13 @@ FLTA::run(llvm::Module &M, llvm::ModuleAnalysisManager &)
 	return PreservedAnalyses::none();
 }
 
+PreservedAnalyses
+FLTALower::run(llvm::Module &M, llvm::ModuleAnalysisManager &)
+{
+	makeMembershipLowering(M);
+	return PreservedAnalyses::none();
+}
+
 //-----------------------------------------------------------------------------
 // New PM Registration
 //-----------------------------------------------------------------------------
@@ -588,6 +1829,11 @@ llvm::PassPluginLibraryInfo getFLTAPluginInfo()
 							MPM.addPass(FLTA());
 							return true;
 						}
+						if (Name == "flta-lower")
+						{
+							MPM.addPass(FLTALower());
+							return true;
+						}
 						return false;
 					});
 			}};
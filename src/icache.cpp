@@ -0,0 +1,223 @@
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "icache.h"
+
+#include <map>
+
+using namespace llvm;
+
+#define ICACHE_SYMBOL "__cfi_icache"
+#define ICACHE_SECTION ".data.cfi_icache"
+#define ICACHE_STATS_SYMBOL "__cfi_icache_stats"
+#define ICACHE_STATS_DTOR "__cfi_icache_report"
+#define ICACHE_TARGETS_SYMBOL "__cfi_icache_targets"
+// Read-only once relocated (RELRO)
+#define ICACHE_TARGETS_SECTION ".data.rel.ro.cfi_icache_targets"
+#define ICACHE_FIND "__cfi_icache_find"
+// Slots are not mprotected, a cache line is enough to keep them apart
+#define CACHE_LINE 64
+
+static GlobalVariable *Cache = nullptr;
+// Calls and hits of each site
+static GlobalVariable *Stats = nullptr;
+// Targets of every site, those of a site are Bounds[Site] (offset, size).
+// Sites with the same targets share them.
+static GlobalVariable *Targets = nullptr;
+static std::vector<std::pair<uint64_t, uint64_t>> Bounds;
+
+static Value *
+getSlot(IRBuilder<> &Builder, GlobalVariable *GV, uint64_t Index)
+{
+	return Builder.CreateConstInBoundsGEP2_64(GV->getValueType(), GV, 0, Index);
+}
+
+// Destructor: sum calls and hits over the sites and print them
+static void
+makeStatsDtor(Module &M, unsigned NumSites)
+{
+	auto &C = M.getContext();
+	auto *I32Ty = Type::getInt32Ty(C);
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto Dprintf = M.getOrInsertFunction(
+		"dprintf", FunctionType::get(I32Ty, {I32Ty, Type::getInt8PtrTy(C)}, true));
+
+	auto *Dtor = Function::Create(
+		FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, ICACHE_STATS_DTOR, M);
+	auto *EntryBB = BasicBlock::Create(C, "entry", Dtor);
+	auto *LoopBB = BasicBlock::Create(C, "loop", Dtor);
+	auto *EndBB = BasicBlock::Create(C, "end", Dtor);
+
+	IRBuilder<> Builder(EntryBB);
+	Builder.CreateBr(LoopBB);
+
+	Builder.SetInsertPoint(LoopBB);
+	auto *Site = Builder.CreatePHI(I64Ty, 2, "site");
+	auto *Calls = Builder.CreatePHI(I64Ty, 2, "calls");
+	auto *Hits = Builder.CreatePHI(I64Ty, 2, "hits");
+	auto Counter = [&](unsigned Field)
+	{
+		auto *Ptr = Builder.CreateInBoundsGEP(
+			Stats->getValueType(), Stats,
+			{Builder.getInt64(0), Builder.CreateAdd(Builder.CreateShl(Site, 1), Builder.getInt64(Field))});
+		return Builder.CreateLoad(I64Ty, Ptr);
+	};
+	auto *NextSite = Builder.CreateAdd(Site, Builder.getInt64(1));
+	auto *NextCalls = Builder.CreateAdd(Calls, Counter(0));
+	auto *NextHits = Builder.CreateAdd(Hits, Counter(1));
+	Builder.CreateCondBr(Builder.CreateICmpULT(NextSite, Builder.getInt64(NumSites)), LoopBB, EndBB);
+	Site->addIncoming(Builder.getInt64(0), EntryBB);
+	Site->addIncoming(NextSite, LoopBB);
+	Calls->addIncoming(Builder.getInt64(0), EntryBB);
+	Calls->addIncoming(NextCalls, LoopBB);
+	Hits->addIncoming(Builder.getInt64(0), EntryBB);
+	Hits->addIncoming(NextHits, LoopBB);
+
+	Builder.SetInsertPoint(EndBB);
+	Builder.CreateCall(Dprintf, {Builder.getInt32(2),
+								 Builder.CreateGlobalStringPtr("CFI icache: %lu calls, %lu hits, %lu misses\n"),
+								 NextCalls, NextHits, Builder.CreateSub(NextCalls, NextHits)});
+	Builder.CreateRetVoid();
+	appendToGlobalDtors(M, Dtor, 0);
+}
+
+// i64 (i64 *targets, i64 n, i64 addr): index of addr in targets, n if it
+// is not there
+static Function *
+getFinder(Module &M)
+{
+	auto Func = M.getFunction(ICACHE_FIND);
+	if (nullptr != Func)
+		return Func;
+
+	auto &C = M.getContext();
+	auto *I64Ty = Type::getInt64Ty(C);
+	Func = Function::Create(
+		FunctionType::get(I64Ty, {I64Ty->getPointerTo(), I64Ty, I64Ty}, false),
+		GlobalValue::InternalLinkage, ICACHE_FIND, M);
+	Func->addFnAttr(Attribute::Cold);
+	auto *Base = Func->getArg(0);
+	auto *N = Func->getArg(1);
+	auto *Addr = Func->getArg(2);
+	auto *EntryBB = BasicBlock::Create(C, "entry", Func);
+	auto *LoopBB = BasicBlock::Create(C, "loop", Func);
+	auto *NextBB = BasicBlock::Create(C, "next", Func);
+	auto *EndBB = BasicBlock::Create(C, "end", Func);
+
+	// n > 0: empty sets get no cache
+	IRBuilder<> Builder(EntryBB);
+	Builder.CreateBr(LoopBB);
+	Builder.SetInsertPoint(LoopBB);
+	auto *I = Builder.CreatePHI(I64Ty, 2, "i");
+	auto *Found = Builder.CreateICmpEQ(Builder.CreateLoad(I64Ty, Builder.CreateGEP(I64Ty, Base, I)), Addr);
+	Builder.CreateCondBr(Found, EndBB, NextBB);
+	Builder.SetInsertPoint(NextBB);
+	auto *Next = Builder.CreateAdd(I, Builder.getInt64(1));
+	Builder.CreateCondBr(Builder.CreateICmpULT(Next, N), LoopBB, EndBB);
+	I->addIncoming(Builder.getInt64(0), EntryBB);
+	I->addIncoming(Next, NextBB);
+
+	Builder.SetInsertPoint(EndBB);
+	auto *Index = Builder.CreatePHI(I64Ty, 2);
+	Index->addIncoming(I, LoopBB);
+	Index->addIncoming(N, NextBB);
+	Builder.CreateRet(Index);
+	return Func;
+}
+
+void makeICache(Module &M, const std::vector<std::vector<Function *>> &SiteTargets, bool WithStats)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	auto NumSites = SiteTargets.size();
+	Cache = nullptr;
+	Stats = nullptr;
+	Targets = nullptr;
+	Bounds.clear();
+	if (0 == NumSites)
+		return;
+
+	std::map<std::vector<Function *>, uint64_t> Offsets;
+	std::vector<Constant *> Addrs;
+	for (auto &&Set : SiteTargets)
+	{
+		auto Inserted = Offsets.emplace(Set, Addrs.size());
+		if (Inserted.second)
+			for (auto &&Func : Set)
+				Addrs.push_back(ConstantExpr::getPtrToInt(Func, I64Ty));
+		Bounds.push_back(std::make_pair(Inserted.first->second, Set.size()));
+	}
+	// A slot of a site with no target must not index past the table
+	Addrs.push_back(ConstantInt::get(I64Ty, 0));
+	auto *TargetsTy = ArrayType::get(I64Ty, Addrs.size());
+	Targets = new GlobalVariable(
+		M, TargetsTy, true, GlobalValue::PrivateLinkage,
+		ConstantArray::get(TargetsTy, Addrs), ICACHE_TARGETS_SYMBOL);
+	// Section names are ELF ones, others keep the default sections
+	bool IsELF = Triple(M.getTargetTriple()).isOSBinFormatELF();
+	if (IsELF)
+		Targets->setSection(ICACHE_TARGETS_SECTION);
+
+	// Whole lines, so no other data shares them
+	auto *CacheTy = ArrayType::get(I64Ty, alignTo(NumSites, CACHE_LINE / 8));
+	Cache = new GlobalVariable(
+		M, CacheTy, false, GlobalValue::PrivateLinkage,
+		ConstantAggregateZero::get(CacheTy), ICACHE_SYMBOL);
+	Cache->setAlignment(Align(CACHE_LINE));
+	if (IsELF)
+		Cache->setSection(ICACHE_SECTION);
+
+	if (WithStats)
+	{
+		auto *StatsTy = ArrayType::get(I64Ty, 2 * NumSites);
+		Stats = new GlobalVariable(
+			M, StatsTy, false, GlobalValue::PrivateLinkage,
+			ConstantAggregateZero::get(StatsTy), ICACHE_STATS_SYMBOL);
+		makeStatsDtor(M, NumSites);
+	}
+}
+
+Value *
+makeICacheLookup(IRBuilder<> &Builder, Value *Addr, unsigned Site)
+{
+	assert(nullptr != Cache && "No cache slot for the site!");
+	// Monotonic is enough: slots are never torn, and an index selects a
+	// valid target whoever wrote it. Out of the bounds of the site, the
+	// select reads its first target and the bound check fails the hit.
+	auto *I64Ty = Builder.getInt64Ty();
+	auto *Slot = Builder.CreateAlignedLoad(I64Ty, getSlot(Builder, Cache, Site), MaybeAlign(8), "cfi.cached");
+	Slot->setAtomic(AtomicOrdering::Monotonic);
+	auto *Offset = Builder.getInt64(Bounds[Site].first);
+	auto *InSet = Builder.CreateICmpULT(Builder.CreateSub(Slot, Offset), Builder.getInt64(Bounds[Site].second));
+	auto *Index = Builder.CreateSelect(InSet, Slot, Offset);
+	auto *Target = Builder.CreateLoad(
+		I64Ty, Builder.CreateInBoundsGEP(Targets->getValueType(), Targets, {Builder.getInt64(0), Index}));
+	auto *Hit = Builder.CreateAnd(InSet, Builder.CreateICmpEQ(Target, Addr));
+
+	if (nullptr != Stats)
+	{
+		Builder.CreateAtomicRMW(AtomicRMWInst::Add, getSlot(Builder, Stats, 2 * Site),
+								Builder.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic);
+		Builder.CreateAtomicRMW(AtomicRMWInst::Add, getSlot(Builder, Stats, 2 * Site + 1),
+								Builder.CreateZExt(Hit, Builder.getInt64Ty()), MaybeAlign(8), AtomicOrdering::Monotonic);
+	}
+	return Hit;
+}
+
+void makeICacheRefresh(IRBuilder<> &Builder, Value *Addr, unsigned Site)
+{
+	// Nothing to remember, the check of an empty set never passes
+	if (0 == Bounds[Site].second)
+		return;
+	auto *Base = getSlot(Builder, Targets, Bounds[Site].first);
+	auto *Found = Builder.CreateCall(
+		getFinder(*Builder.GetInsertBlock()->getModule()),
+		{Base, Builder.getInt64(Bounds[Site].second), Addr});
+	// A coarser check (cluster, prefix) may pass a target not in the set,
+	// its index is out of bounds and never hits
+	auto *Store = Builder.CreateAlignedStore(
+		Builder.CreateAdd(Found, Builder.getInt64(Bounds[Site].first)),
+		getSlot(Builder, Cache, Site), MaybeAlign(8));
+	Store->setAtomic(AtomicOrdering::Monotonic);
+}
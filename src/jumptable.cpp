@@ -0,0 +1,148 @@
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "bitset.h"
+#include "jumptable.h"
+
+using namespace llvm;
+
+#define JUMPTABLE_SYMBOL "__cfi_jumptable"
+
+// x86-64: `jmp rel32` is 5 bytes, padded with int3 to the entry size
+#define JUMPTABLE_ENTRY_SHIFT 3
+#define JUMPTABLE_ENTRY_ASM(i, Size) \
+	"jmp ${" + std::to_string(i) + ":c}@plt\n.balign " + std::to_string(Size) + ", 0xcc\n"
+
+static Function *JumpTable = nullptr;
+static DenseMap<const Function *, uint64_t> EntryIndex;
+// Entry handed out for each function, of any table
+static DenseMap<const Function *, Constant *> Entries;
+
+bool isJumpTableCandidate(const Function *Func)
+{
+	return !Func->isDeclaration() && !Func->hasAvailableExternallyLinkage() && !Func->isIntrinsic();
+}
+
+// Replace the uses of Func taking its address by Entry. Direct calls keep
+// calling Func itself.
+static void
+replaceAddressTakenUses(Function *Func, Constant *Entry, CallInst *JumpTableCall)
+{
+	SmallSetVector<Constant *, 4> Constants;
+	for (auto &&U : make_early_inc_range(Func->uses()))
+	{
+		auto *Usr = U.getUser();
+		if (Usr == JumpTableCall || isa<BlockAddress>(Usr) || isa<GlobalAlias>(Usr))
+			continue;
+		if (auto *CB = dyn_cast<CallBase>(Usr))
+			if (CB->isCallee(&U))
+				continue;
+		// Constants are uniqued, they have to rebuild themselves
+		auto *C = dyn_cast<Constant>(Usr);
+		if (nullptr != C && !isa<GlobalValue>(C))
+		{
+			Constants.insert(C);
+			continue;
+		}
+		U.set(Entry);
+	}
+	for (auto &&C : Constants)
+		C->handleOperandChange(Func, Entry);
+}
+
+void clearJumpTableEntries()
+{
+	Entries.clear();
+}
+
+Function *
+makeJumpTableFunction(Module &M, StringRef Name, const std::vector<Function *> &Funcs, unsigned EntryShift)
+{
+	if (Funcs.empty())
+		return nullptr;
+	if (Triple(M.getTargetTriple()).getArch() != Triple::x86_64)
+		report_fatal_error("FLTA: jump tables are only implemented for x86-64");
+
+	auto &Ctx = M.getContext();
+	auto *Table = Function::Create(
+		FunctionType::get(Type::getVoidTy(Ctx), false),
+		GlobalValue::PrivateLinkage, Name, &M);
+	Table->setAlignment(Align(1ULL << EntryShift));
+	Table->addFnAttr(Attribute::Naked);
+	Table->addFnAttr(Attribute::NoUnwind);
+
+	// One inline asm holding all entries, each function as an "s" operand
+	std::string AsmStr;
+	std::string Constraints;
+	std::vector<Value *> Args;
+	std::vector<Type *> ArgTys;
+	for (unsigned i = 0; i < Funcs.size(); i++)
+	{
+		AsmStr += JUMPTABLE_ENTRY_ASM(i, 1ULL << EntryShift);
+		Constraints += i ? ",s" : "s";
+		Args.push_back(Funcs[i]);
+		ArgTys.push_back(Funcs[i]->getType());
+	}
+	auto *AsmTy = FunctionType::get(Type::getVoidTy(Ctx), ArgTys, false);
+	IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Table));
+	auto *TableCall = Builder.CreateCall(
+		AsmTy, InlineAsm::get(AsmTy, AsmStr, Constraints, true), Args);
+	Builder.CreateUnreachable();
+
+	auto *I8Ty = Type::getInt8Ty(Ctx);
+	auto *Base = ConstantExpr::getBitCast(Table, Type::getInt8PtrTy(Ctx));
+	for (unsigned i = 0; i < Funcs.size(); i++)
+	{
+		auto *Entry = ConstantExpr::getBitCast(
+			ConstantExpr::getGetElementPtr(
+				I8Ty, Base,
+				ConstantInt::get(Type::getInt64Ty(Ctx), (uint64_t)i << EntryShift)),
+			Funcs[i]->getType());
+		replaceAddressTakenUses(Funcs[i], Entry, TableCall);
+		Entries[Funcs[i]] = Entry;
+	}
+	return Table;
+}
+
+void makeJumpTable(Module &M, const std::vector<Function *> &Funcs)
+{
+	EntryIndex.clear();
+	clearJumpTableEntries();
+	JumpTable = makeJumpTableFunction(M, JUMPTABLE_SYMBOL, Funcs, JUMPTABLE_ENTRY_SHIFT);
+	for (unsigned i = 0; i < Funcs.size(); i++)
+		EntryIndex[Funcs[i]] = i;
+}
+
+Constant *
+getJumpTableEntry(Function *Func)
+{
+	auto It = Entries.find(Func);
+	if (It == Entries.end())
+		return Func;
+	return It->second;
+}
+
+Value *
+makeJumpTableCheck(Module &M, IRBuilder<> &Builder, Value *Addr, const std::vector<Function *> &Targets)
+{
+	std::vector<uint64_t> Offsets;
+	for (auto &&Target : Targets)
+	{
+		auto It = EntryIndex.find(Target);
+		assert(It != EntryIndex.end() && "Target is not in the jump table!");
+		Offsets.push_back(It->second << JUMPTABLE_ENTRY_SHIFT);
+	}
+
+	BitSet BS;
+	bool Aligned = makeBitSet(M, Offsets, JUMPTABLE_ENTRY_SHIFT, BS);
+	assert(Aligned && "Jump table entries are evenly spaced!");
+	(void)Aligned;
+	return makeBitSetTest(
+		Builder, Addr,
+		ConstantExpr::getPtrToInt(JumpTable, Builder.getInt64Ty()),
+		BS);
+}
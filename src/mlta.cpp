@@ -3,6 +3,7 @@
 #include "llvm/IR/Instructions.h"
 
 #include "mlta.h"
+#include "castflow.h"
 #include "utils.h"
 
 using namespace llvm;
@@ -172,6 +173,10 @@ makeMLT2InstFuncMapping()
             if (auto GEPI = dyn_cast<GetElementPtrInst>(Val))
             {
                 auto Ty = GEPI->getPointerOperandType();
+                // look through the cast to i8* for the real layer type
+                if (isI8PtrTy(Ty))
+                    if (auto FlowTy = getValueFlowTy(GEPI->getPointerOperand()))
+                        Ty = FlowTy;
 
                 if (std::find(MLTy.begin(), MLTy.end(), Ty) == MLTy.end())
                     MLTy.push_back(Ty);
@@ -192,6 +197,9 @@ makeMLT2InstFuncMapping()
             if (auto GEPOp = dyn_cast<GEPOperator>(Val))
             {
                 auto Ty = GEPOp->getPointerOperandType();
+                if (isI8PtrTy(Ty))
+                    if (auto FlowTy = getValueFlowTy(GEPOp->getPointerOperand()))
+                        Ty = FlowTy;
 
                 if (std::find(MLTy.begin(), MLTy.end(), Ty) == MLTy.end())
                     MLTy.push_back(Ty);
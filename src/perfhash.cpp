@@ -0,0 +1,353 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "perfhash.h"
+#include "sortedset.h"
+
+using namespace llvm;
+
+#define MPH_KEYS_SYMBOL "__cfi_mph_keys"
+#define MPH_TABLES_SYMBOL "__cfi_mph_tables"
+#define MPH_BUILDER "__cfi_mph_build"
+#define MPH_CTOR "__cfi_build_mphs"
+#define MPH_STATS_ENV "CFI_MPH_STATS"
+#define CLOCK_MONOTONIC 1
+#define GOLDEN_GAMMA 0x9e3779b97f4a7c15ULL
+
+struct PerfectHash
+{
+	uint64_t Keys;     // offset of the keys in __cfi_mph_keys
+	uint64_t Table;    // offset of the slots in __cfi_mph_tables, one per key
+	uint64_t Pilots;   // offset of the pilots in __cfi_mph_tables, one per bucket
+	uint64_t NumKeys;
+	uint64_t NumBuckets;
+};
+
+static std::vector<PerfectHash> Hashes;
+
+// x ^= x >> 33; x *= 0xff51afd7ed558ccd; x ^= x >> 33;
+static Value *
+makeMix(IRBuilder<> &Builder, Value *X)
+{
+	X = Builder.CreateXor(X, Builder.CreateLShr(X, 33));
+	X = Builder.CreateMul(X, Builder.getInt64(0xff51afd7ed558ccdULL));
+	return Builder.CreateXor(X, Builder.CreateLShr(X, 33));
+}
+
+static Value *
+makeBucketHash(IRBuilder<> &Builder, Value *Key, Value *NumBuckets)
+{
+	return Builder.CreateURem(makeMix(Builder, Key), NumBuckets);
+}
+
+// The pilot moves the key to another slot: mix(key ^ (pilot + 1) * gamma)
+static Value *
+makeSlotHash(IRBuilder<> &Builder, Value *Key, Value *Pilot, Value *NumKeys)
+{
+	auto *Seed = Builder.CreateMul(
+		Builder.CreateAdd(Pilot, Builder.getInt64(1)),
+		Builder.getInt64(GOLDEN_GAMMA));
+	return Builder.CreateURem(makeMix(Builder, Builder.CreateXor(Key, Seed)), NumKeys);
+}
+
+// Emit `for (i = Start; i < End; i++) Body(i)` and leave Builder after it
+static void
+makeLoop(IRBuilder<> &Builder, Value *Start, Value *End, function_ref<void(Value *)> Body)
+{
+	auto &C = Builder.getContext();
+	auto *Func = Builder.GetInsertBlock()->getParent();
+	auto *PreBB = Builder.GetInsertBlock();
+	auto *CondBB = BasicBlock::Create(C, "loop.cond", Func);
+	auto *BodyBB = BasicBlock::Create(C, "loop.body", Func);
+	auto *EndBB = BasicBlock::Create(C, "loop.end", Func);
+
+	Builder.CreateBr(CondBB);
+	Builder.SetInsertPoint(CondBB);
+	auto *IV = Builder.CreatePHI(Builder.getInt64Ty(), 2, "i");
+	IV->addIncoming(Start, PreBB);
+	Builder.CreateCondBr(Builder.CreateICmpULT(IV, End), BodyBB, EndBB);
+
+	Builder.SetInsertPoint(BodyBB);
+	Body(IV);
+	IV->addIncoming(Builder.CreateAdd(IV, Builder.getInt64(1)), Builder.GetInsertBlock());
+	Builder.CreateBr(CondBB);
+	Builder.SetInsertPoint(EndBB);
+}
+
+// Emit `if (Cond) Then()` and leave Builder after it
+static void
+makeIf(IRBuilder<> &Builder, Value *Cond, function_ref<void()> Then)
+{
+	auto &C = Builder.getContext();
+	auto *Func = Builder.GetInsertBlock()->getParent();
+	auto *ThenBB = BasicBlock::Create(C, "if.then", Func);
+	auto *EndBB = BasicBlock::Create(C, "if.end", Func);
+	Builder.CreateCondBr(Cond, ThenBB, EndBB);
+	Builder.SetInsertPoint(ThenBB);
+	Then();
+	Builder.CreateBr(EndBB);
+	Builder.SetInsertPoint(EndBB);
+}
+
+// void (i64 *keys, i64 n, i64 nb, i64 *table, i64 *pilots), table zeroed:
+//   pairs = {bucket(key), key} for each key, sorted by bucket;
+//   the bucket becomes (~size << 32 | bucket), sorted again: largest first;
+//   for each bucket, try pilots until all its keys land in free slots.
+static Function *
+makeBuilder(Module &M)
+{
+	auto &C = M.getContext();
+	auto *I8PtrTy = Type::getInt8PtrTy(C);
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *I64PtrTy = Type::getInt64PtrTy(C);
+	auto *Cmp = getKeyCompare(M);
+	auto Malloc = M.getOrInsertFunction("malloc", I8PtrTy, I64Ty);
+	auto Free = M.getOrInsertFunction("free", Type::getVoidTy(C), I8PtrTy);
+	auto QSort = M.getOrInsertFunction(
+		"qsort", Type::getVoidTy(C), I8PtrTy, I64Ty, I64Ty, Cmp->getType());
+
+	auto *Func = Function::Create(
+		FunctionType::get(Type::getVoidTy(C), {I64PtrTy, I64Ty, I64Ty, I64PtrTy, I64PtrTy}, false),
+		GlobalValue::InternalLinkage, MPH_BUILDER, M);
+	auto *Keys = Func->getArg(0);
+	auto *N = Func->getArg(1);
+	auto *NB = Func->getArg(2);
+	auto *Table = Func->getArg(3);
+	auto *Pilots = Func->getArg(4);
+	Keys->setName("keys");
+	N->setName("n");
+	NB->setName("nb");
+	Table->setName("table");
+	Pilots->setName("pilots");
+
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Func));
+	auto *RunStart = Builder.CreateAlloca(I64Ty, nullptr, "run.start");
+	auto *Pilot = Builder.CreateAlloca(I64Ty, nullptr, "pilot");
+	auto *Placed = Builder.CreateAlloca(I64Ty, nullptr, "placed");
+
+	auto *PairsMem = Builder.CreateCall(Malloc, {Builder.CreateMul(N, Builder.getInt64(16))});
+	auto *Pairs = Builder.CreateBitCast(PairsMem, I64PtrTy);
+	auto PairAt = [&](Value *I, unsigned Field)
+	{
+		return Builder.CreateGEP(
+			I64Ty, Pairs,
+			Builder.CreateAdd(Builder.CreateShl(I, 1), Builder.getInt64(Field)));
+	};
+	auto KeyAt = [&](Value *I)
+	{ return Builder.CreateLoad(I64Ty, PairAt(I, 1)); };
+	auto SortPairs = [&]()
+	{ Builder.CreateCall(QSort, {PairsMem, N, Builder.getInt64(16), Cmp}); };
+	// Whether I is the last element of its run of equal first fields
+	auto RunEndsAt = [&](Value *I)
+	{
+		auto *Next = Builder.CreateAdd(I, Builder.getInt64(1));
+		auto *IsLast = Builder.CreateICmpEQ(Next, N);
+		// clamped so the load stays in bounds
+		auto *Other = Builder.CreateSelect(IsLast, I, Next);
+		auto *Differs = Builder.CreateICmpNE(
+			Builder.CreateLoad(I64Ty, PairAt(I, 0)),
+			Builder.CreateLoad(I64Ty, PairAt(Other, 0)));
+		return Builder.CreateOr(IsLast, Differs);
+	};
+
+	makeLoop(Builder, Builder.getInt64(0), N, [&](Value *I)
+			 {
+				 auto *Key = Builder.CreateLoad(I64Ty, Builder.CreateGEP(I64Ty, Keys, I));
+				 Builder.CreateStore(makeBucketHash(Builder, Key, NB), PairAt(I, 0));
+				 Builder.CreateStore(Key, PairAt(I, 1)); });
+	SortPairs();
+
+	Builder.CreateStore(Builder.getInt64(0), RunStart);
+	makeLoop(Builder, Builder.getInt64(0), N, [&](Value *I)
+			 { makeIf(Builder, RunEndsAt(I), [&]()
+					  {
+						  auto *Start = Builder.CreateLoad(I64Ty, RunStart);
+						  auto *End = Builder.CreateAdd(I, Builder.getInt64(1));
+						  auto *Size = Builder.CreateSub(End, Start);
+						  auto *Bucket = Builder.CreateLoad(I64Ty, PairAt(I, 0));
+						  auto *Order = Builder.CreateOr(
+							  Builder.CreateShl(Builder.CreateNot(Size), 32), Bucket);
+						  makeLoop(Builder, Start, End, [&](Value *J)
+								   { Builder.CreateStore(Order, PairAt(J, 0)); });
+						  Builder.CreateStore(End, RunStart); }); });
+	SortPairs();
+
+	Builder.CreateStore(Builder.getInt64(0), RunStart);
+	makeLoop(Builder, Builder.getInt64(0), N, [&](Value *I)
+			 { makeIf(Builder, RunEndsAt(I), [&]()
+					  {
+						  auto *Start = Builder.CreateLoad(I64Ty, RunStart);
+						  auto *End = Builder.CreateAdd(I, Builder.getInt64(1));
+						  auto *Bucket = Builder.CreateAnd(
+							  Builder.CreateLoad(I64Ty, PairAt(I, 0)),
+							  Builder.getInt64(0xffffffff));
+						  Builder.CreateStore(Builder.getInt64(0), Pilot);
+
+						  // placed = start; while (placed < end && slot of key[placed] is free or its own) put it
+						  auto *TryBB = BasicBlock::Create(C, "try", Func);
+						  auto *PutBB = BasicBlock::Create(C, "put", Func);
+						  auto *NextBB = BasicBlock::Create(C, "next", Func);
+						  auto *UndoBB = BasicBlock::Create(C, "undo", Func);
+						  auto *DoneBB = BasicBlock::Create(C, "done", Func);
+						  Builder.CreateStore(Start, Placed);
+						  Builder.CreateBr(TryBB);
+
+						  Builder.SetInsertPoint(TryBB);
+						  auto *K = Builder.CreateLoad(I64Ty, Placed);
+						  Builder.CreateCondBr(Builder.CreateICmpULT(K, End), PutBB, DoneBB);
+
+						  Builder.SetInsertPoint(PutBB);
+						  auto *Key = KeyAt(K);
+						  auto *Slot = Builder.CreateGEP(
+							  I64Ty, Table,
+							  makeSlotHash(Builder, Key, Builder.CreateLoad(I64Ty, Pilot), N));
+						  auto *Cur = Builder.CreateLoad(I64Ty, Slot);
+						  // The same address twice (aliases) shares its slot
+						  auto *Free = Builder.CreateOr(
+							  Builder.CreateICmpEQ(Cur, Builder.getInt64(0)),
+							  Builder.CreateICmpEQ(Cur, Key));
+						  Builder.CreateStore(Key, Slot);
+						  Builder.CreateCondBr(Free, NextBB, UndoBB);
+
+						  Builder.SetInsertPoint(NextBB);
+						  Builder.CreateStore(Builder.CreateAdd(K, Builder.getInt64(1)), Placed);
+						  Builder.CreateBr(TryBB);
+
+						  // Taken: free the slots of this bucket and try the next pilot
+						  Builder.SetInsertPoint(UndoBB);
+						  Builder.CreateStore(Cur, Slot);
+						  auto *Failed = Builder.CreateLoad(I64Ty, Placed);
+						  auto *P = Builder.CreateLoad(I64Ty, Pilot);
+						  makeLoop(Builder, Start, Failed, [&](Value *J)
+								   {
+									   auto *Undo = Builder.CreateGEP(
+										   I64Ty, Table, makeSlotHash(Builder, KeyAt(J), P, N));
+									   Builder.CreateStore(Builder.getInt64(0), Undo); });
+						  Builder.CreateStore(Builder.CreateAdd(P, Builder.getInt64(1)), Pilot);
+						  Builder.CreateStore(Start, Placed);
+						  Builder.CreateBr(TryBB);
+
+						  Builder.SetInsertPoint(DoneBB);
+						  Builder.CreateStore(
+							  Builder.CreateLoad(I64Ty, Pilot),
+							  Builder.CreateGEP(I64Ty, Pilots, Bucket));
+						  Builder.CreateStore(End, RunStart); }); });
+
+	Builder.CreateCall(Free, {PairsMem});
+	Builder.CreateRetVoid();
+	return Func;
+}
+
+// Elapsed ns from Start to Stop, {i64, i64} timespecs
+static Value *
+makeElapsedNs(IRBuilder<> &Builder, Value *Start, Value *Stop)
+{
+	auto *TimeSpecTy = StructType::get(Builder.getInt64Ty(), Builder.getInt64Ty());
+	auto Get = [&](Value *TS, unsigned Field)
+	{ return Builder.CreateLoad(Builder.getInt64Ty(), Builder.CreateStructGEP(TimeSpecTy, TS, Field)); };
+	return Builder.CreateAdd(
+		Builder.CreateMul(Builder.CreateSub(Get(Stop, 0), Get(Start, 0)), Builder.getInt64(1000000000)),
+		Builder.CreateSub(Get(Stop, 1), Get(Start, 1)));
+}
+
+// Constructor: build every table, mprotect them read-only, report the time
+static void
+makeBuildCtor(Module &M, GlobalVariable *Keys, GlobalVariable *Tables, uint64_t TablesSize)
+{
+	auto &C = M.getContext();
+	auto *I8PtrTy = Type::getInt8PtrTy(C);
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *I32Ty = Type::getInt32Ty(C);
+	auto *TimeSpecTy = StructType::get(I64Ty, I64Ty);
+	auto ClockGetTime = M.getOrInsertFunction(
+		"clock_gettime", I32Ty, I32Ty, TimeSpecTy->getPointerTo());
+	auto GetEnv = M.getOrInsertFunction("getenv", I8PtrTy, I8PtrTy);
+	auto Dprintf = M.getOrInsertFunction("dprintf", FunctionType::get(I32Ty, {I32Ty, I8PtrTy}, true));
+	auto *Build = makeBuilder(M);
+
+	auto *Ctor = Function::Create(
+		FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, MPH_CTOR, M);
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Ctor));
+	auto *Start = Builder.CreateAlloca(TimeSpecTy, nullptr, "start");
+	auto *Stop = Builder.CreateAlloca(TimeSpecTy, nullptr, "stop");
+	Builder.CreateCall(ClockGetTime, {Builder.getInt32(CLOCK_MONOTONIC), Start});
+
+	auto Elem = [&](GlobalVariable *GV, uint64_t Offset)
+	{ return Builder.CreateConstInBoundsGEP2_64(GV->getValueType(), GV, 0, Offset); };
+	for (auto &&Hash : Hashes)
+	{
+		Builder.CreateCall(Build, {Elem(Keys, Hash.Keys), Builder.getInt64(Hash.NumKeys),
+								   Builder.getInt64(Hash.NumBuckets),
+								   Elem(Tables, Hash.Table), Elem(Tables, Hash.Pilots)});
+	}
+	makeTableReadOnly(M, Builder, Tables, TablesSize * 8);
+	Builder.CreateCall(ClockGetTime, {Builder.getInt32(CLOCK_MONOTONIC), Stop});
+
+	auto *Env = Builder.CreateCall(GetEnv, {Builder.CreateGlobalStringPtr(MPH_STATS_ENV)});
+	makeIf(Builder, Builder.CreateIsNotNull(Env), [&]()
+		   { Builder.CreateCall(Dprintf, {Builder.getInt32(2),
+										  Builder.CreateGlobalStringPtr("CFI: %lu perfect hash tables built in %lu ns\n"),
+										  Builder.getInt64(Hashes.size()),
+										  makeElapsedNs(Builder, Start, Stop)}); });
+	Builder.CreateRetVoid();
+	// Before any constructor of the program may make an icall
+	appendToGlobalCtors(M, Ctor, 0);
+}
+
+void makePerfectHashes(Module &M, const std::vector<std::vector<Function *>> &Sets)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	std::vector<Constant *> Keys;
+	uint64_t TablesSize = 0;
+	Hashes.clear();
+	for (auto &&Set : Sets)
+	{
+		PerfectHash Hash;
+		Hash.Keys = Keys.size();
+		Hash.NumKeys = Set.size();
+		// Two keys per bucket on average
+		Hash.NumBuckets = std::max<uint64_t>(1, Set.size() / 2);
+		Hash.Table = TablesSize;
+		Hash.Pilots = TablesSize + Hash.NumKeys;
+		TablesSize += Hash.NumKeys + Hash.NumBuckets;
+		Hashes.push_back(Hash);
+		for (auto &&Func : Set)
+			Keys.push_back(ConstantExpr::getPtrToInt(Func, I64Ty));
+	}
+	if (Keys.empty())
+		return;
+
+	auto *KeysTy = ArrayType::get(I64Ty, Keys.size());
+	auto *KeysGV = new GlobalVariable(
+		M, KeysTy, true, GlobalValue::PrivateLinkage,
+		ConstantArray::get(KeysTy, Keys), MPH_KEYS_SYMBOL);
+	// Whole pages, so mprotect does not touch anything else
+	TablesSize = alignTo(TablesSize, TABLE_PAGE_SIZE / 8);
+	auto *TablesTy = ArrayType::get(I64Ty, TablesSize);
+	auto *Tables = new GlobalVariable(
+		M, TablesTy, false, GlobalValue::PrivateLinkage,
+		ConstantAggregateZero::get(TablesTy), MPH_TABLES_SYMBOL);
+	Tables->setAlignment(Align(TABLE_PAGE_SIZE));
+	makeBuildCtor(M, KeysGV, Tables, TablesSize);
+}
+
+Value *
+makePerfectHashCheck(Module &M, IRBuilder<> &Builder, Value *Addr, unsigned SetID)
+{
+	auto *I64Ty = Builder.getInt64Ty();
+	auto *Tables = M.getNamedGlobal(MPH_TABLES_SYMBOL);
+	assert(nullptr != Tables && SetID < Hashes.size() && "The set has no perfect hash!");
+	auto &Hash = Hashes[SetID];
+	auto Elem = [&](uint64_t Offset, Value *Index)
+	{
+		return Builder.CreateInBoundsGEP(
+			Tables->getValueType(), Tables,
+			{Builder.getInt64(0), Builder.CreateAdd(Index, Builder.getInt64(Offset))});
+	};
+
+	auto *Bucket = makeBucketHash(Builder, Addr, Builder.getInt64(Hash.NumBuckets));
+	auto *Pilot = Builder.CreateLoad(I64Ty, Elem(Hash.Pilots, Bucket));
+	auto *Slot = makeSlotHash(Builder, Addr, Pilot, Builder.getInt64(Hash.NumKeys));
+	return Builder.CreateICmpEQ(Builder.CreateLoad(I64Ty, Elem(Hash.Table, Slot)), Addr);
+}
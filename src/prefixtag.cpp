@@ -0,0 +1,74 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InlineAsm.h"
+
+#include "prefixtag.h"
+
+using namespace llvm;
+
+// The high half marks the word as a tag, the low half is the class.
+// Functions carry the negated tag, and checks compare with the tag itself,
+// so the immediate of a check never forms a valid tag in the code.
+#define PREFIX_TAG_MAGIC 0xcf170000u
+#define PREFIX_TAG_SIZE 4
+
+static DenseMap<const Function *, unsigned> Func2Tag;
+
+bool isPrefixTagCandidate(const Function *Func)
+{
+	return !Func->isDeclaration() && !Func->hasAvailableExternallyLinkage() &&
+		   !Func->isIntrinsic() && !Func->hasPrefixData();
+}
+
+static uint32_t
+getTagValue(unsigned Class)
+{
+	assert(Class <= 0xffff && "Too many classes for a prefix tag");
+	return PREFIX_TAG_MAGIC | Class;
+}
+
+void makePrefixTags(Module &M, const std::vector<std::vector<Function *>> &Classes)
+{
+	auto *I32Ty = Type::getInt32Ty(M.getContext());
+	Func2Tag.clear();
+	for (unsigned i = 0; i < Classes.size(); i++)
+	{
+		for (auto &&Func : Classes[i])
+		{
+			if (!isPrefixTagCandidate(Func) || Func2Tag.count(Func))
+				continue;
+			Func->setPrefixData(ConstantInt::get(I32Ty, -getTagValue(i)));
+			Func2Tag[Func] = i;
+		}
+	}
+}
+
+int getPrefixTag(const Function *Func)
+{
+	auto It = Func2Tag.find(Func);
+	if (It == Func2Tag.end())
+		return -1;
+	return It->second;
+}
+
+Value *
+makePrefixTagCheck(IRBuilder<> &Builder, Value *Addr, const std::vector<unsigned> &Classes)
+{
+	auto *I32Ty = Builder.getInt32Ty();
+	auto *TagAddr = Builder.CreateIntToPtr(
+		Builder.CreateSub(Addr, Builder.getInt64(PREFIX_TAG_SIZE)),
+		I32Ty->getPointerTo());
+	// Prefix data only follows the function alignment
+	auto *Tag = Builder.CreateAlignedLoad(I32Ty, TagAddr, MaybeAlign(1), "cfi.tag");
+
+	// An empty asm hides the tag, so `tag + stored == 0` is not folded
+	// back into a compare with the stored word
+	auto *HideTy = FunctionType::get(I32Ty, {I32Ty}, false);
+	auto *Hide = InlineAsm::get(HideTy, "", "=r,0", false);
+	Value *OK = Builder.getFalse();
+	for (auto &&Class : Classes)
+	{
+		auto *Expected = Builder.CreateCall(HideTy, Hide, {Builder.getInt32(getTagValue(Class))});
+		OK = Builder.CreateOr(OK, Builder.CreateICmpEQ(Builder.CreateAdd(Tag, Expected), Builder.getInt32(0)));
+	}
+	return OK;
+}
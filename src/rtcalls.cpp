@@ -0,0 +1,129 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "rtcalls.h"
+
+using namespace llvm;
+
+#define RT_SETS_SYMBOL "__cfi_rt_sets"
+#define RT_SET_DESCS_SYMBOL "__cfi_rt_set_descs"
+#define RT_CTOR "__cfi_rt_register"
+#define RT_LOG_CTOR "__cfi_log_register"
+// Where the calls counted before __cfi_log_init go
+#define RT_LOG_DISCARD "__cfi_log_discard"
+// Fields of struct __cfi_log_site
+#define LOG_SITE_FIELDS 3
+
+void makeRuntimeSets(Module &M, const std::vector<std::vector<Function *>> &Sets)
+{
+	auto &C = M.getContext();
+	auto *I32Ty = Type::getInt32Ty(C);
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *I64PtrTy = Type::getInt64PtrTy(C);
+	// struct __cfi_set_desc { const uint64_t *Addrs; uint64_t Size; }
+	auto *DescTy = StructType::get(I64PtrTy, I64Ty);
+	if (Sets.empty())
+		return;
+
+	std::vector<Constant *> Addrs;
+	for (auto &&Set : Sets)
+		for (auto &&Func : Set)
+			Addrs.push_back(ConstantExpr::getPtrToInt(Func, I64Ty));
+	auto *AddrsTy = ArrayType::get(I64Ty, Addrs.size());
+	auto *AddrsGV = new GlobalVariable(
+		M, AddrsTy, true, GlobalValue::PrivateLinkage,
+		ConstantArray::get(AddrsTy, Addrs), RT_SETS_SYMBOL);
+
+	std::vector<Constant *> Descs;
+	uint64_t Offset = 0;
+	for (auto &&Set : Sets)
+	{
+		Descs.push_back(ConstantStruct::get(
+			DescTy,
+			ConstantExpr::getInBoundsGetElementPtr(
+				AddrsTy, AddrsGV,
+				ArrayRef<Constant *>{ConstantInt::get(I64Ty, 0), ConstantInt::get(I64Ty, Offset)}),
+			ConstantInt::get(I64Ty, Set.size())));
+		Offset += Set.size();
+	}
+	auto *DescsTy = ArrayType::get(DescTy, Descs.size());
+	auto *DescsGV = new GlobalVariable(
+		M, DescsTy, true, GlobalValue::PrivateLinkage,
+		ConstantArray::get(DescsTy, Descs), RT_SET_DESCS_SYMBOL);
+
+	auto Init = M.getOrInsertFunction(RT_INIT, Type::getVoidTy(C), DescTy->getPointerTo(), I32Ty);
+	auto *Ctor = Function::Create(
+		FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, RT_CTOR, M);
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Ctor));
+	Builder.CreateCall(Init, {Builder.CreateConstInBoundsGEP2_64(DescsTy, DescsGV, 0, 0),
+							  Builder.getInt32(Descs.size())});
+	Builder.CreateRetVoid();
+	// Before any constructor of the program may make an icall
+	appendToGlobalCtors(M, Ctor, 0);
+}
+
+Value *
+makeRuntimeCheck(Module &M, IRBuilder<> &Builder, Value *Addr, unsigned SetID)
+{
+	auto Check = M.getOrInsertFunction(
+		RT_CHECK, Builder.getInt32Ty(), Builder.getInt32Ty(), Builder.getInt64Ty());
+	auto *Found = Builder.CreateCall(Check, {Builder.getInt32(SetID), Addr});
+	return Builder.CreateIsNotNull(Found);
+}
+
+Function *getRuntimeReport(Module &M)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	auto Report = M.getOrInsertFunction(RT_REPORT, Type::getVoidTy(M.getContext()), I64Ty, I64Ty);
+	auto *Func = cast<Function>(Report.getCallee());
+	Func->setDoesNotReturn();
+	Func->setDoesNotThrow();
+	Func->addFnAttr(Attribute::Cold);
+	return Func;
+}
+
+void makeLogSegment(Module &M, uint64_t NumSites)
+{
+	auto *I32Ty = Type::getInt32Ty(M.getContext());
+	auto Init = M.getOrInsertFunction(RT_LOG_INIT, Type::getVoidTy(M.getContext()), I32Ty);
+	auto *Ctor = Function::Create(
+		FunctionType::get(Type::getVoidTy(M.getContext()), false),
+		GlobalValue::InternalLinkage, RT_LOG_CTOR, M);
+	IRBuilder<> Builder(BasicBlock::Create(M.getContext(), "entry", Ctor));
+	Builder.CreateCall(Init, {Builder.getInt32(NumSites)});
+	Builder.CreateRetVoid();
+	appendToGlobalCtors(M, Ctor, 0);
+}
+
+void makeLogCount(Module &M, IRBuilder<> &Builder, uint64_t Site)
+{
+	auto *I64Ty = Builder.getInt64Ty();
+	auto *I64PtrTy = I64Ty->getPointerTo();
+	auto *Sites = M.getOrInsertGlobal(RT_LOG_SITES, I64PtrTy);
+	auto *Discard = M.getOrInsertGlobal(RT_LOG_DISCARD, ArrayType::get(I64Ty, LOG_SITE_FIELDS), [&]
+	{
+		return new GlobalVariable(
+			M, ArrayType::get(I64Ty, LOG_SITE_FIELDS), false, GlobalValue::InternalLinkage,
+			ConstantAggregateZero::get(ArrayType::get(I64Ty, LOG_SITE_FIELDS)), RT_LOG_DISCARD);
+	});
+
+	// The calls of constructors running before ours are not counted
+	Value *Base = Builder.CreateLoad(I64PtrTy, Sites);
+	auto *DiscardBase = ConstantExpr::getBitCast(Discard, I64PtrTy);
+	auto *SiteIdx = Builder.getInt64(Site * LOG_SITE_FIELDS);
+	auto *Calls = Builder.CreateSelect(
+		Builder.CreateIsNull(Base), DiscardBase, Builder.CreateGEP(I64Ty, Base, SiteIdx));
+	Builder.CreateAtomicRMW(
+		AtomicRMWInst::Add, Calls, Builder.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic);
+}
+
+Function *getLogReport(Module &M)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	auto Report = M.getOrInsertFunction(RT_LOG_VIOLATION, Type::getVoidTy(M.getContext()), I64Ty, I64Ty);
+	auto *Func = cast<Function>(Report.getCallee());
+	Func->setDoesNotThrow();
+	Func->addFnAttr(Attribute::Cold);
+	return Func;
+}
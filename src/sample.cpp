@@ -0,0 +1,31 @@
+#include "llvm/IR/Constants.h"
+
+#include "sample.h"
+
+using namespace llvm;
+
+#define SAMPLE_SYMBOL "__cfi_sample_counters"
+
+static GlobalVariable *Counters = nullptr;
+
+void makeSampleCounters(Module &M, unsigned NumSites)
+{
+	auto *CountersTy = ArrayType::get(Type::getInt32Ty(M.getContext()), NumSites);
+	// Initial-exec: a plain %fs-relative access, no __tls_get_addr call
+	Counters = new GlobalVariable(
+		M, CountersTy, false, GlobalValue::InternalLinkage,
+		ConstantAggregateZero::get(CountersTy), SAMPLE_SYMBOL, nullptr,
+		GlobalValue::InitialExecTLSModel);
+}
+
+Value *
+makeSampleGate(IRBuilder<> &Builder, unsigned Site, unsigned Rate)
+{
+	auto *Slot = Builder.CreateConstInBoundsGEP2_64(Counters->getValueType(), Counters, 0, Site);
+	auto *Count = Builder.CreateLoad(Builder.getInt32Ty(), Slot);
+	auto *Check = Builder.CreateICmpEQ(Count, Builder.getInt32(0));
+	// Branch-free: reload Rate - 1 when checking, count down otherwise
+	auto *Next = Builder.CreateSelect(Check, Builder.getInt32(Rate - 1), Builder.CreateSub(Count, Builder.getInt32(1)));
+	Builder.CreateStore(Next, Slot);
+	return Check;
+}
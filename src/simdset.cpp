@@ -0,0 +1,152 @@
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalIFunc.h"
+
+#include "simdset.h"
+
+using namespace llvm;
+
+#define SIMD_SETS_SYMBOL "__cfi_simd_sets"
+#define SIMD_MEMBER "__cfi_simd_member"
+#define SIMD_RESOLVER "__cfi_simd_resolve"
+#define CACHE_LINE 64
+// Widest vector, in addresses: every set is padded to it
+#define SIMD_LANES_MAX 4
+// Bits of __cpu_model.__cpu_features[0], as in libgcc
+#define FEATURE_SSE2 4
+#define FEATURE_AVX2 10
+
+// Offset and padded size of each set, in addresses
+static std::vector<std::pair<uint64_t, uint64_t>> SetBounds;
+static GlobalValue *Member = nullptr;
+
+// i1 (i64 *set, i64 n, i64 key), n a multiple of Lanes: compare Lanes
+// addresses at a time, OR the results, test the mask once at the end
+static Function *
+makeMemberVariant(Module &M, unsigned Lanes, StringRef Suffix, StringRef Features)
+{
+	auto &C = M.getContext();
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *I64PtrTy = Type::getInt64PtrTy(C);
+	auto *VecTy = FixedVectorType::get(I64Ty, Lanes);
+	auto *Func = Function::Create(
+		FunctionType::get(Type::getInt1Ty(C), {I64PtrTy, I64Ty, I64Ty}, false),
+		GlobalValue::InternalLinkage, SIMD_MEMBER "_" + Suffix, M);
+	if (!Features.empty())
+		Func->addFnAttr("target-features", Features);
+	auto *Set = Func->getArg(0);
+	auto *N = Func->getArg(1);
+	auto *Key = Func->getArg(2);
+	Set->setName("set");
+	N->setName("n");
+	Key->setName("key");
+
+	auto *EntryBB = BasicBlock::Create(C, "entry", Func);
+	auto *LoopBB = BasicBlock::Create(C, "loop", Func);
+	auto *EndBB = BasicBlock::Create(C, "end", Func);
+	IRBuilder<> Builder(EntryBB);
+	auto *Keys = Builder.CreateVectorSplat(Lanes, Key, "keys");
+	Builder.CreateBr(LoopBB);
+
+	// Sets are never empty
+	Builder.SetInsertPoint(LoopBB);
+	auto *I = Builder.CreatePHI(I64Ty, 2, "i");
+	// Lanes of all ones on a match, kept full width so they stay in vector
+	// registers
+	auto *Acc = Builder.CreatePHI(VecTy, 2, "acc");
+	auto *Ptr = Builder.CreateBitCast(Builder.CreateGEP(I64Ty, Set, I), VecTy->getPointerTo());
+	auto *Addrs = Builder.CreateAlignedLoad(VecTy, Ptr, MaybeAlign(8 * Lanes));
+	auto *NextAcc = Builder.CreateOr(Acc, Builder.CreateSExt(Builder.CreateICmpEQ(Addrs, Keys), VecTy));
+	auto *NextI = Builder.CreateAdd(I, Builder.getInt64(Lanes));
+	Builder.CreateCondBr(Builder.CreateICmpULT(NextI, N), LoopBB, EndBB);
+	I->addIncoming(Builder.getInt64(0), EntryBB);
+	I->addIncoming(NextI, LoopBB);
+	Acc->addIncoming(Constant::getNullValue(Acc->getType()), EntryBB);
+	Acc->addIncoming(NextAcc, LoopBB);
+
+	// movemask
+	Builder.SetInsertPoint(EndBB);
+	auto *Mask = Builder.CreateBitCast(Builder.CreateIsNotNull(NextAcc), Builder.getIntNTy(Lanes));
+	Builder.CreateRet(Builder.CreateIsNotNull(Mask));
+	return Func;
+}
+
+// Resolver of the ifunc: the widest variant the CPU supports. It runs
+// before constructors, so it calls __cpu_indicator_init itself.
+static Function *
+makeResolver(Module &M, Function *AVX2, Function *SSE2, Function *Scalar)
+{
+	auto &C = M.getContext();
+	auto *I32Ty = Type::getInt32Ty(C);
+	auto *CPUModelTy = StructType::get(I32Ty, I32Ty, I32Ty, ArrayType::get(I32Ty, 1));
+	auto *CPUModel = M.getOrInsertGlobal("__cpu_model", CPUModelTy);
+	auto CPUInit = M.getOrInsertFunction("__cpu_indicator_init", Type::getVoidTy(C));
+
+	auto *Resolver = Function::Create(
+		FunctionType::get(Scalar->getType(), false),
+		GlobalValue::InternalLinkage, SIMD_RESOLVER, M);
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Resolver));
+	Builder.CreateCall(CPUInit);
+	auto *Features = Builder.CreateLoad(
+		I32Ty, Builder.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 3, 0, ""));
+	auto Has = [&](unsigned Bit)
+	{ return Builder.CreateIsNotNull(Builder.CreateAnd(Features, Builder.getInt32(1u << Bit))); };
+	Builder.CreateRet(Builder.CreateSelect(
+		Has(FEATURE_AVX2), AVX2,
+		Builder.CreateSelect(Has(FEATURE_SSE2), SSE2, Scalar)));
+	return Resolver;
+}
+
+void makeSIMDSets(Module &M, const std::vector<std::vector<Function *>> &Sets)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	std::vector<Constant *> Addrs;
+	SetBounds.clear();
+	Member = nullptr;
+	for (auto &&Set : Sets)
+	{
+		// Each set starts a cache line
+		Addrs.resize(alignTo(Addrs.size(), CACHE_LINE / 8), ConstantInt::get(I64Ty, 0));
+		auto Start = Addrs.size();
+		for (auto &&Func : Set)
+			Addrs.push_back(ConstantExpr::getPtrToInt(Func, I64Ty));
+		// Repeating a member pads without adding one
+		while ((Addrs.size() - Start) % SIMD_LANES_MAX)
+			Addrs.push_back(Addrs[Start]);
+		SetBounds.push_back(std::make_pair(Start, Addrs.size() - Start));
+	}
+	if (Addrs.empty())
+		return;
+
+	auto *SetsTy = ArrayType::get(I64Ty, Addrs.size());
+	auto *SetsGV = new GlobalVariable(
+		M, SetsTy, true, GlobalValue::PrivateLinkage,
+		ConstantArray::get(SetsTy, Addrs), SIMD_SETS_SYMBOL);
+	SetsGV->setAlignment(Align(CACHE_LINE));
+
+	auto *Scalar = makeMemberVariant(M, 1, "scalar", "");
+	if (Triple(M.getTargetTriple()).getArch() != Triple::x86_64)
+	{
+		Member = Scalar;
+		return;
+	}
+	auto *AVX2 = makeMemberVariant(M, 4, "avx2", "+avx,+avx2");
+	auto *SSE2 = makeMemberVariant(M, 2, "sse2", "+sse2");
+	Member = GlobalIFunc::create(
+		Scalar->getFunctionType(), 0, GlobalValue::InternalLinkage, SIMD_MEMBER,
+		makeResolver(M, AVX2, SSE2, Scalar), &M);
+}
+
+Value *
+makeSIMDSetCheck(Module &M, IRBuilder<> &Builder, Value *Addr, unsigned SetID)
+{
+	auto *SetsGV = M.getNamedGlobal(SIMD_SETS_SYMBOL);
+	assert(nullptr != SetsGV && nullptr != Member && SetID < SetBounds.size() && "The set is not laid out!");
+	auto *Set = ConstantExpr::getInBoundsGetElementPtr(
+		SetsGV->getValueType(), SetsGV,
+		ArrayRef<Constant *>{Builder.getInt64(0), Builder.getInt64(SetBounds[SetID].first)});
+	auto *MemberTy = cast<FunctionType>(Member->getValueType());
+	return Builder.CreateCall(
+		MemberTy, Member,
+		{Set, Builder.getInt64(SetBounds[SetID].second), Addr});
+}
@@ -0,0 +1,180 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "sortedset.h"
+
+using namespace llvm;
+
+#define SORTED_SETS_SYMBOL "__cfi_sorted_sets"
+#define SORTED_SETS_CTOR "__cfi_sort_sets"
+#define SORTED_SETS_CMP "__cfi_cmp_key"
+#define SORTED_SET_SEARCH "__cfi_set_search"
+#define PROT_READ 1
+
+// Offset and size of each set in the table, in addresses
+static std::vector<std::pair<uint64_t, uint64_t>> SetBounds;
+
+Function *
+getKeyCompare(Module &M)
+{
+	auto Func = M.getFunction(SORTED_SETS_CMP);
+	if (nullptr != Func)
+		return Func;
+
+	auto &C = M.getContext();
+	auto *I8PtrTy = Type::getInt8PtrTy(C);
+	auto *I64PtrTy = Type::getInt64PtrTy(C);
+	Func = Function::Create(
+		FunctionType::get(Type::getInt32Ty(C), {I8PtrTy, I8PtrTy}, false),
+		GlobalValue::InternalLinkage, SORTED_SETS_CMP, M);
+
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Func));
+	auto *Left = Builder.CreateLoad(Builder.getInt64Ty(), Builder.CreateBitCast(Func->getArg(0), I64PtrTy));
+	auto *Right = Builder.CreateLoad(Builder.getInt64Ty(), Builder.CreateBitCast(Func->getArg(1), I64PtrTy));
+	// (left > right) - (left < right)
+	Builder.CreateRet(Builder.CreateSub(
+		Builder.CreateZExt(Builder.CreateICmpUGT(Left, Right), Builder.getInt32Ty()),
+		Builder.CreateZExt(Builder.CreateICmpULT(Left, Right), Builder.getInt32Ty())));
+	return Func;
+}
+
+void makeTableReadOnly(Module &M, IRBuilder<> &Builder, GlobalVariable *Table, uint64_t Bytes)
+{
+	auto &C = M.getContext();
+	auto *I8PtrTy = Type::getInt8PtrTy(C);
+	auto *I32Ty = Type::getInt32Ty(C);
+	auto MProtect = M.getOrInsertFunction("mprotect", I32Ty, I8PtrTy, Type::getInt64Ty(C), I32Ty);
+	auto Perror = M.getOrInsertFunction("perror", Type::getVoidTy(C), I8PtrTy);
+	auto Abort = M.getOrInsertFunction("abort", Type::getVoidTy(C));
+
+	auto *Ret = Builder.CreateCall(MProtect, {Builder.CreateBitCast(Table, I8PtrTy),
+											  Builder.getInt64(Bytes), Builder.getInt32(PROT_READ)});
+	auto *Func = Builder.GetInsertBlock()->getParent();
+	auto *FailBB = BasicBlock::Create(C, "mprotect.fail", Func);
+	auto *DoneBB = BasicBlock::Create(C, "mprotect.done", Func);
+	Builder.CreateCondBr(Builder.CreateIsNotNull(Ret), FailBB, DoneBB);
+	Builder.SetInsertPoint(FailBB);
+	Builder.CreateCall(Perror, {Builder.CreateGlobalStringPtr("CFI: mprotect")});
+	Builder.CreateCall(Abort)->setDoesNotReturn();
+	Builder.CreateUnreachable();
+	Builder.SetInsertPoint(DoneBB);
+}
+
+// Constructor: qsort every set in place, then mprotect the table read-only
+static void
+makeSortCtor(Module &M, GlobalVariable *Table, uint64_t TableSize)
+{
+	auto &C = M.getContext();
+	auto *I8PtrTy = Type::getInt8PtrTy(C);
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *Cmp = getKeyCompare(M);
+	auto QSort = M.getOrInsertFunction(
+		"qsort", Type::getVoidTy(C), I8PtrTy, I64Ty, I64Ty, Cmp->getType());
+
+	auto *Ctor = Function::Create(
+		FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, SORTED_SETS_CTOR, M);
+	IRBuilder<> Builder(BasicBlock::Create(C, "entry", Ctor));
+	for (auto &&Bounds : SetBounds)
+	{
+		auto *Base = Builder.CreateConstInBoundsGEP2_64(Table->getValueType(), Table, 0, Bounds.first);
+		Builder.CreateCall(QSort, {Builder.CreateBitCast(Base, I8PtrTy),
+								   Builder.getInt64(Bounds.second), Builder.getInt64(8), Cmp});
+	}
+	makeTableReadOnly(M, Builder, Table, TableSize * 8);
+	Builder.CreateRetVoid();
+	// Before any constructor of the program may make an icall
+	appendToGlobalCtors(M, Ctor, 0);
+}
+
+void makeSortedSets(Module &M, const std::vector<std::vector<Function *>> &Sets)
+{
+	auto *I64Ty = Type::getInt64Ty(M.getContext());
+	std::vector<Constant *> Addrs;
+	SetBounds.clear();
+	for (auto &&Set : Sets)
+	{
+		SetBounds.push_back(std::make_pair(Addrs.size(), Set.size()));
+		for (auto &&Func : Set)
+			Addrs.push_back(ConstantExpr::getPtrToInt(Func, I64Ty));
+	}
+	if (Addrs.empty())
+		return;
+	// Whole pages, so mprotect does not touch anything else
+	Addrs.resize(alignTo(Addrs.size(), TABLE_PAGE_SIZE / 8), ConstantInt::get(I64Ty, 0));
+
+	auto *TableTy = ArrayType::get(I64Ty, Addrs.size());
+	auto *Table = new GlobalVariable(
+		M, TableTy, false, GlobalValue::PrivateLinkage,
+		ConstantArray::get(TableTy, Addrs), SORTED_SETS_SYMBOL);
+	Table->setAlignment(Align(TABLE_PAGE_SIZE));
+	makeSortCtor(M, Table, Addrs.size());
+}
+
+// i1 (i64 *base, i64 n, i64 key): the last element not above key is found
+// with a select per step, n > 0
+//   while (n > 1) { half = n / 2; if (base[half] <= key) base += half; n -= half; }
+//   return *base == key;
+static Function *
+makeSetSearch(Module &M)
+{
+	auto Func = M.getFunction(SORTED_SET_SEARCH);
+	if (nullptr != Func)
+		return Func;
+
+	auto &C = M.getContext();
+	auto *I64Ty = Type::getInt64Ty(C);
+	auto *I64PtrTy = Type::getInt64PtrTy(C);
+	Func = Function::Create(
+		FunctionType::get(Type::getInt1Ty(C), {I64PtrTy, I64Ty, I64Ty}, false),
+		GlobalValue::InternalLinkage, SORTED_SET_SEARCH, M);
+	auto *Base = Func->getArg(0);
+	auto *Len = Func->getArg(1);
+	auto *Key = Func->getArg(2);
+	Base->setName("base");
+	Len->setName("n");
+	Key->setName("key");
+
+	auto *EntryBB = BasicBlock::Create(C, "entry", Func);
+	auto *LoopBB = BasicBlock::Create(C, "loop", Func);
+	auto *BodyBB = BasicBlock::Create(C, "body", Func);
+	auto *EndBB = BasicBlock::Create(C, "end", Func);
+
+	IRBuilder<> Builder(EntryBB);
+	Builder.CreateBr(LoopBB);
+
+	Builder.SetInsertPoint(LoopBB);
+	auto *CurBase = Builder.CreatePHI(I64PtrTy, 2, "cur.base");
+	auto *CurLen = Builder.CreatePHI(I64Ty, 2, "cur.n");
+	Builder.CreateCondBr(Builder.CreateICmpUGT(CurLen, Builder.getInt64(1)), BodyBB, EndBB);
+
+	Builder.SetInsertPoint(BodyBB);
+	auto *Half = Builder.CreateLShr(CurLen, 1, "half");
+	auto *Mid = Builder.CreateInBoundsGEP(I64Ty, CurBase, Half);
+	auto *Below = Builder.CreateICmpULE(Builder.CreateLoad(I64Ty, Mid), Key);
+	auto *NextBase = Builder.CreateSelect(Below, Mid, CurBase);
+	auto *NextLen = Builder.CreateSub(CurLen, Half);
+	Builder.CreateBr(LoopBB);
+
+	CurBase->addIncoming(Base, EntryBB);
+	CurBase->addIncoming(NextBase, BodyBB);
+	CurLen->addIncoming(Len, EntryBB);
+	CurLen->addIncoming(NextLen, BodyBB);
+
+	Builder.SetInsertPoint(EndBB);
+	Builder.CreateRet(Builder.CreateICmpEQ(Builder.CreateLoad(I64Ty, CurBase), Key));
+	return Func;
+}
+
+Value *
+makeSortedSetCheck(Module &M, IRBuilder<> &Builder, Value *Addr, unsigned SetID)
+{
+	auto *Table = M.getNamedGlobal(SORTED_SETS_SYMBOL);
+	assert(nullptr != Table && SetID < SetBounds.size() && "The set is not in the table!");
+	auto *Base = ConstantExpr::getInBoundsGetElementPtr(
+		Table->getValueType(), Table,
+		ArrayRef<Constant *>{Builder.getInt64(0), Builder.getInt64(SetBounds[SetID].first)});
+	return Builder.CreateCall(
+		makeSetSearch(M),
+		{Base, Builder.getInt64(SetBounds[SetID].second), Addr});
+}
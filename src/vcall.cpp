@@ -0,0 +1,250 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+
+#include "bitset.h"
+#include "vcall.h"
+
+#include <map>
+
+using namespace llvm;
+
+#define VTABLES_SYMBOL "__cfi_vtables"
+
+// Address points are pointer aligned, the check rotates the low bits away.
+#define ADDR_POINT_SHIFT 3
+
+static std::vector<VCallSite> VCalls;
+static SmallPtrSet<const CallBase *, 16> VCallSet;
+// Vtable pointer (casts stripped) -> static type from its type test
+static DenseMap<const Value *, Metadata *> VTable2TypeId;
+
+// Initialized via layoutVTables()
+static GlobalVariable *VTables = nullptr;
+
+// Type id -> its compatible address points, as offsets into VTables
+static DenseMap<Metadata *, BitSet> TypeIdInfos;
+
+void initVCalls(Module &M)
+{
+	VCalls.clear();
+	VCallSet.clear();
+	VTable2TypeId.clear();
+
+	auto *TypeTest = M.getFunction(Intrinsic::getName(Intrinsic::type_test));
+	if (nullptr == TypeTest)
+		return;
+	for (auto &&U : TypeTest->users())
+	{
+		auto *CI = dyn_cast<CallInst>(U);
+		if (nullptr == CI)
+			continue;
+		auto *TypeId = cast<MetadataAsValue>(CI->getArgOperand(1))->getMetadata();
+		VTable2TypeId[CI->getArgOperand(0)->stripPointerCasts()] = TypeId;
+	}
+
+	auto &DL = M.getDataLayout();
+	for (auto &Func : M)
+		for (auto &BB : Func)
+			for (auto &Inst : BB)
+			{
+				auto *CB = dyn_cast<CallBase>(&Inst);
+				if (nullptr == CB || !CB->isIndirectCall())
+					continue;
+
+				// %vfn = load (gep %vtable, slot)
+				auto *LI = dyn_cast<LoadInst>(CB->getCalledOperand()->stripPointerCasts());
+				if (nullptr == LI)
+					continue;
+				APInt Offset(DL.getIndexTypeSizeInBits(LI->getPointerOperandType()), 0);
+				auto *VTable = LI->getPointerOperand()->stripAndAccumulateConstantOffsets(DL, Offset, true);
+				auto It = VTable2TypeId.find(VTable->stripPointerCasts());
+				if (It == VTable2TypeId.end())
+					continue;
+
+				VCalls.push_back({CB, VTable, It->second});
+				VCallSet.insert(CB);
+			}
+}
+
+bool isVCall(const CallBase *ICall)
+{
+	return VCallSet.count(ICall) != 0;
+}
+
+const std::vector<VCallSite> &
+getVCalls()
+{
+	return VCalls;
+}
+
+static void
+getTypes(GlobalVariable *GV, SmallVectorImpl<std::pair<uint64_t, Metadata *>> &Types)
+{
+	SmallVector<MDNode *, 4> MDs;
+	GV->getMetadata(LLVMContext::MD_type, MDs);
+	for (auto &&MD : MDs)
+	{
+		auto *Offset = mdconst::extract<ConstantInt>(MD->getOperand(0));
+		Types.push_back(std::make_pair(Offset->getZExtValue(), MD->getOperand(1).get()));
+	}
+}
+
+void layoutVTables(Module &M)
+{
+	VTables = nullptr;
+	TypeIdInfos.clear();
+	if (VCalls.empty())
+		return;
+
+	std::vector<GlobalVariable *> GVs;
+	for (auto &GV : M.globals())
+	{
+		// available_externally vtables live elsewhere, we cannot move them
+		if (GV.hasMetadata(LLVMContext::MD_type) && GV.hasInitializer() && !GV.hasAvailableExternallyLinkage())
+			GVs.push_back(&GV);
+	}
+
+	// Order along the hierarchy: a vtable is keyed by its type ids, most
+	// common (i.e. base classes) first, so subclasses sort after their base.
+	DenseMap<Metadata *, std::pair<unsigned, unsigned>> Rank;
+	for (auto &&GV : GVs)
+	{
+		SmallVector<std::pair<uint64_t, Metadata *>, 4> Types;
+		getTypes(GV, Types);
+		for (auto &&Type : Types)
+		{
+			auto It = Rank.insert(std::make_pair(Type.second, std::make_pair(0u, Rank.size())));
+			It.first->second.first++;
+		}
+	}
+	auto Key = [&Rank](GlobalVariable *GV)
+	{
+		SmallVector<std::pair<uint64_t, Metadata *>, 4> Types;
+		getTypes(GV, Types);
+		std::vector<std::pair<int, unsigned>> Key;
+		for (auto &&Type : Types)
+			Key.push_back(std::make_pair(-(int)Rank[Type.second].first, Rank[Type.second].second));
+		std::sort(Key.begin(), Key.end());
+		Key.erase(std::unique(Key.begin(), Key.end()), Key.end());
+		return Key;
+	};
+	std::stable_sort(GVs.begin(), GVs.end(),
+					 [&Key](GlobalVariable *Left, GlobalVariable *Right)
+					 { return Key(Left) < Key(Right); });
+
+	// Lay the vtables out back to back in one packed struct
+	auto &DL = M.getDataLayout();
+	auto *I8Ty = Type::getInt8Ty(M.getContext());
+	std::vector<Constant *> Inits;
+	std::vector<Type *> Tys;
+	std::vector<std::pair<unsigned, uint64_t>> Fields; // (field index, offset) per GV
+	uint64_t Offset = 0;
+	Align MaxAlign(8);
+	for (auto &&GV : GVs)
+	{
+		Align GVAlign = std::max(DL.getValueOrABITypeAlignment(GV->getAlign(), GV->getValueType()), Align(8));
+		MaxAlign = std::max(MaxAlign, GVAlign);
+		uint64_t Padding = alignTo(Offset, GVAlign) - Offset;
+		if (Padding)
+		{
+			auto *PadTy = ArrayType::get(I8Ty, Padding);
+			Tys.push_back(PadTy);
+			Inits.push_back(ConstantAggregateZero::get(PadTy));
+			Offset += Padding;
+		}
+		Fields.push_back(std::make_pair(Tys.size(), Offset));
+		Tys.push_back(GV->getValueType());
+		Inits.push_back(GV->getInitializer());
+		Offset += DL.getTypeAllocSize(GV->getValueType());
+	}
+	auto *VTablesTy = StructType::get(M.getContext(), Tys, true);
+	VTables = new GlobalVariable(
+		M, VTablesTy, true, GlobalValue::PrivateLinkage,
+		ConstantStruct::get(VTablesTy, Inits), VTABLES_SYMBOL);
+	VTables->setAlignment(MaxAlign);
+
+	// Replace every vtable with an alias into VTables, and move its type
+	// ids over so other type tests still see them.
+	std::map<Metadata *, std::vector<uint64_t>> AddrPoints;
+	auto *I32Ty = Type::getInt32Ty(M.getContext());
+	for (unsigned i = 0; i < GVs.size(); i++)
+	{
+		auto *GV = GVs[i];
+		SmallVector<std::pair<uint64_t, Metadata *>, 4> Types;
+		getTypes(GV, Types);
+		for (auto &&Type : Types)
+		{
+			AddrPoints[Type.second].push_back(Fields[i].second + Type.first);
+			VTables->addTypeMetadata(Fields[i].second + Type.first, Type.second);
+		}
+
+		Constant *Indices[] = {ConstantInt::get(I32Ty, 0), ConstantInt::get(I32Ty, Fields[i].first)};
+		auto *Alias = GlobalAlias::create(
+			GV->getValueType(), GV->getAddressSpace(), GV->getLinkage(), "",
+			ConstantExpr::getInBoundsGetElementPtr(VTablesTy, VTables, Indices), &M);
+		Alias->takeName(GV);
+		Alias->setVisibility(GV->getVisibility());
+		Alias->setDLLStorageClass(GV->getDLLStorageClass());
+		GV->replaceAllUsesWith(Alias);
+		GV->eraseFromParent();
+	}
+
+	for (auto &&Elem : AddrPoints)
+	{
+		BitSet BS;
+		if (makeBitSet(M, Elem.second, ADDR_POINT_SHIFT, BS))
+			TypeIdInfos[Elem.first] = BS;
+	}
+
+	// Type ids we could not lay out fall back to the plain icall check
+	std::vector<VCallSite> Checkable;
+	for (auto &&VCall : VCalls)
+	{
+		if (TypeIdInfos.count(VCall.TypeId))
+			Checkable.push_back(VCall);
+		else
+			VCallSet.erase(VCall.ICall);
+	}
+	VCalls.swap(Checkable);
+}
+
+Value *
+makeVTableCheck(IRBuilder<> &Builder, const VCallSite &VCall)
+{
+	auto *I64Ty = Builder.getInt64Ty();
+	auto *Base = ConstantExpr::getPtrToInt(VTables, I64Ty);
+	return makeBitSetTest(
+		Builder,
+		Builder.CreatePtrToInt(VCall.VTable, I64Ty),
+		Base,
+		TypeIdInfos[VCall.TypeId]);
+}
+
+void dropVCallTypeTests(Module &M)
+{
+	auto *TypeTest = M.getFunction(Intrinsic::getName(Intrinsic::type_test));
+	if (nullptr == TypeTest)
+		return;
+
+	SmallPtrSet<const Value *, 16> CheckedVTables;
+	for (auto &&VCall : VCalls)
+		CheckedVTables.insert(VCall.VTable->stripPointerCasts());
+
+	std::vector<CallInst *> Dead;
+	for (auto &&U : TypeTest->users())
+	{
+		auto *CI = dyn_cast<CallInst>(U);
+		if (nullptr != CI && CheckedVTables.count(CI->getArgOperand(0)->stripPointerCasts()))
+			Dead.push_back(CI);
+	}
+	for (auto &&CI : Dead)
+	{
+		for (auto &&U : make_early_inc_range(CI->users()))
+			if (auto *Assume = dyn_cast<AssumeInst>(U))
+				Assume->eraseFromParent();
+		CI->replaceAllUsesWith(ConstantInt::getTrue(M.getContext()));
+		CI->eraseFromParent();
+	}
+}
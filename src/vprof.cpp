@@ -0,0 +1,41 @@
+#include "llvm/ProfileData/InstrProf.h"
+
+#include "vprof.h"
+
+using namespace llvm;
+
+// As many targets as the profile keeps per site
+#define VP_MAX_TARGETS 255
+
+static InstrProfSymtab Symtab;
+
+void initICallProfile(Module &M)
+{
+	Symtab = InstrProfSymtab();
+	if (Error E = Symtab.create(M))
+		consumeError(std::move(E));
+}
+
+std::vector<std::pair<Function *, uint64_t>>
+getICallProfile(const CallBase *ICall, uint64_t &Total)
+{
+	std::vector<std::pair<Function *, uint64_t>> Profile;
+	InstrProfValueData Data[VP_MAX_TARGETS];
+	uint32_t NumData = 0;
+	Total = 0;
+	if (!getValueProfDataFromInst(*ICall, IPVK_IndirectCallTarget, VP_MAX_TARGETS,
+								  Data, NumData, Total))
+		return Profile;
+
+	for (uint32_t i = 0; i < NumData; i++)
+	{
+		auto *Func = Symtab.getFunction(Data[i].Value);
+		if (nullptr != Func)
+			Profile.push_back(std::make_pair(Func, Data[i].Count));
+	}
+	// Already sorted in the metadata, but nothing requires it
+	std::stable_sort(Profile.begin(), Profile.end(),
+					 [](const std::pair<Function *, uint64_t> &Left, const std::pair<Function *, uint64_t> &Right)
+					 { return Left.second > Right.second; });
+	return Profile;
+}